@@ -5,6 +5,7 @@
 import sys
 import os
 import configparser
+import re
 
 PROG_NAME = os.path.splitext(os.path.basename(__file__))[0]
 PROG_DIR = os.path.dirname(os.path.realpath(__file__))
@@ -81,8 +82,8 @@ def get_module_filename(modname):
 
 # ----------------------------------------------------------------------
 
-def insmod(modname):
-    config.run(['insmod', modname])
+def insmod(modname, params = {}):
+    config.run(['insmod', modname] + ['%s=%s' % (k, v) for k, v in params.items()])
 
 # ----------------------------------------------------------------------
 
@@ -96,8 +97,8 @@ def is_module_loaded():
 
 # ----------------------------------------------------------------------
 
-def load_module():
-    insmod(get_module_filename(config.KMOD_NAME))
+def load_module(params = {}):
+    insmod(get_module_filename(config.KMOD_NAME), params)
 
 # ----------------------------------------------------------------------
 
@@ -126,9 +127,18 @@ def load_from_ini(filename):
         throw('%s: File not found' % (filename))
 
     dev_counts = { ifc: 0 for ifc in config.IFACES }
-    cfg = {}
+    dev_names = {}
+    cfg = { '_params': {} }
 
     for sect in ini.sections():
+        if sect == config.KMOD_NAME:
+            # kernel module parameters
+            for k, v in ini[sect].items():
+                if not k in config.KMOD_PARAMS:
+                    error('Invalid module parameter: %s' % (k))
+                cfg['_params'][k] = v
+            continue
+
         ifc = config.extern_dev_name_to_iface(sect)
 
         if ifc is None:
@@ -138,16 +148,74 @@ def load_from_ini(filename):
             cfg[ifc] = {}
 
         i = 0
-        pairs = { '_extern_dev_name': sect, }
+        options = {}
+        pairs = { '_extern_dev_name': sect, '_options': options, }
 
         # Do some checking. The kernel module won't
         # let a bad string pass anyway, but the error
         # message may be a bit cryptic.
 
-        if dev_counts[ifc] == config.HWE_MAX_DEVICES:
+        max_devs = {
+            config.IF_NET: config.HWE_MAX_NET_DEVICES,
+            config.IF_I2C: config.HWE_MAX_I2C_DEVICES,
+        }.get(ifc, config.HWE_MAX_DEVICES)
+
+        if dev_counts[ifc] == max_devs:
             error('Too many %s devices' % (ifc))
 
+        if ifc == config.IF_NET and ':' in sect:
+            # an endpoint of a network device, e.g. [eth0:10.0.0.5]
+            # or [eth0:02:00:00:00:00:01]
+            parent, addr = sect.split(':', 1)
+
+            if not parent in dev_names:
+                error('Endpoint %s refers to an unknown device' % (sect))
+
+            if re.fullmatch(r'([0-9a-fA-F]{2}:){5}[0-9a-fA-F]{2}', addr):
+                kind = 'mac'
+            else:
+                kind = 'ip'
+
+            pairs['_parent'] = dev_names[parent]
+            pairs['_add_options'] = 'parent=%s %s=%s' % \
+                (dev_names[parent], kind, addr)
+        elif ifc == config.IF_NET:
+            # the kernel module creates the network device with the
+            # name of the section and brings it up
+            if len(sect) >= config.IFNAMSIZ:
+                error('Network device name too long: %s' % (sect))
+
+            pairs['_add_options'] = 'name=%s up' % (sect)
+        elif ifc == config.IF_I2C and ':' in sect:
+            # a client of an adapter, e.g. [i2c-0:0x50]; addresses
+            # above 0x7F are 10-bit ones
+            parent, addr = sect.split(':', 1)
+
+            if not parent in dev_names:
+                error('Client %s refers to an unknown device' % (sect))
+
+            try:
+                n = int(addr, 16)
+            except ValueError:
+                error('Invalid client address: %s' % (sect))
+
+            if n < 0 or n > 0x3FF:
+                error('Client address out of range: %s' % (sect))
+
+            pairs['_parent'] = dev_names[parent]
+            pairs['_add_options'] = 'parent=%s addr=0x%x%s' % \
+                (dev_names[parent], n, ' ten' if n > 0x7F else '')
+
         for k, v in ini[sect].items():
+            if k.startswith(config.OPTION_PREFIX):
+                name = k[len(config.OPTION_PREFIX):]
+
+                if not config.is_option_name(name):
+                    error('Invalid option name: %s' % (k))
+
+                options[name] = v
+                continue
+
             k2 = convert_quoted(k)
             v2 = convert_quoted(v)
 
@@ -158,7 +226,7 @@ def load_from_ini(filename):
                 if (len(k2) & 1) != 0:
                     error('Odd number of characters in request string: %s' % (k))
 
-                if is_quoted(k) and k2 in ini[dev_name].keys():
+                if is_quoted(k) and k2 in ini[sect]:
                     # error: quoted string has an equal byte representation
                     error('Duplicate key: %s' % (k))
             else:
@@ -182,7 +250,8 @@ def load_from_ini(filename):
             pairs[i] = k2 + '=' + v2
             i += 1
 
-        cfg[ifc][ifc + str(dev_counts[ifc])] = pairs
+        dev_names[sect] = ifc + str(dev_counts[ifc])
+        cfg[ifc][dev_names[sect]] = pairs
         dev_counts[ifc] += 1
 
     return cfg
@@ -221,10 +290,10 @@ def cmd_start(filename):
         config.ifaces_cleanup()
         unload_module()
 
-    load_module()
-
     cfg = load_from_ini(filename)
 
+    load_module(cfg['_params'])
+
     config.write_config(cfg)
 
     config.ifaces_init(cfg)
@@ -233,6 +302,46 @@ def cmd_start(filename):
 
 # ----------------------------------------------------------------------
 
+MODULE_PARAMS_DIR = '/sys/module/%s/parameters' % (config.KMOD_NAME)
+
+def cmd_reload(filename):
+    ensure_root()
+
+    # validate the file before touching anything
+    cfg = load_from_ini(filename)
+    params = cfg['_params']
+
+    def restart():
+        # reload is not protected by the cleanup in __main__
+        try:
+            cmd_start(filename)
+        except:
+            try: cleanup()
+            except: pass
+            raise
+
+    if not is_module_loaded():
+        restart()
+        return
+
+    # spi_chipselects can only be set when the module is loaded
+    cur = config.read_file(MODULE_PARAMS_DIR + '/spi_chipselects').strip()
+
+    if int(params.get('spi_chipselects', '1'), 0) != int(cur):
+        restart()
+        return
+
+    created = config.reload_config(cfg)
+
+    for p in ('log_requests', 'log_responses'):
+        config.write_file('%s/%s' % (MODULE_PARAMS_DIR, p), params.get(p, '0'))
+
+    config.ifaces_init(created)
+
+    check_group()
+
+# ----------------------------------------------------------------------
+
 def cmd_stop():
     ensure_root()
 
@@ -247,11 +356,11 @@ def cmd_debug(filename):
 
     ensure_root()
 
-    load_module()
-
     cfg = load_from_ini(filename)
     #print(config.config_to_str(cfg))
 
+    load_module(cfg['_params'])
+
     config.write_config(cfg)
 
 # ----------------------------------------------------------------------
@@ -296,6 +405,15 @@ _OPTS = {
         'descr': 'Start the emulator using the configuration '+
                  'provided in <filename>.',
     },
+    'reload': {
+        'fn': cmd_reload,
+        'arg': 'filename',
+        # a failed reload leaves the running emulator alone
+        'keep_on_error': True,
+        'descr': 'Apply the configuration provided in <filename> to '+
+                 'the running emulator, creating and removing only '+
+                 'the devices whose sections were added or removed.',
+    },
     'stop': {
         'fn': cmd_stop,
         'descr': 'Stop the emulator.',
@@ -368,15 +486,20 @@ if __name__ == '__main__':
         main(sys.argv)
         exit_code = 0
     except Exception as ex:
+        keep = len(sys.argv) > 1 and \
+            _OPTS.get(sys.argv[1], {}).get('keep_on_error', False)
+
         # don't show the traceback when we're not debugging
         if _DEBUG:
-            cleanup()
+            if not keep:
+                cleanup()
             print(traceback.format_exc())
         else:
             # if something goes wrong, try to clean up the mess
             # ignoring new errors
-            try: cleanup()
-            except: pass
+            if not keep:
+                try: cleanup()
+                except: pass
 
             print('*** ERROR: ' + str(ex))
 
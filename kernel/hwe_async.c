@@ -11,6 +11,8 @@
 #include <linux/printk.h>
 #include <linux/uaccess.h>
 #include <linux/jiffies.h>
+#include <linux/hrtimer.h>
+#include <linux/sched.h>
 
 #include "hwemu.h"
 
@@ -83,6 +85,17 @@ static void timer_func(struct timer_list *t)
 	add_timer(t);
 }
 
+/*! Sleeps for \a ns nanoseconds. This is used to emulate bus timing,
+ * so the sleep is timed by an hrtimer, with no slack. A fatal signal
+ * ends the sleep early, so that a stuck client can be killed. */
+void hwe_delay_ns(u64 ns)
+{
+	ktime_t t = ns_to_ktime(ns);
+
+	set_current_state(TASK_KILLABLE);
+	schedule_hrtimeout_range(&t, 0, HRTIMER_MODE_REL);
+}
+
 extern int hwe_init_async(void)
 {
 	int err = 0;
@@ -15,6 +15,14 @@
 /*! Maximum length of a request-response string */
 #define HWE_MAX_PAIR_STR	(HWE_MAX_REQUEST * 2 + HWE_MAX_RESPONSE * 2 + 1)
 
+/*! Maximum length of the name of a device node, e.g. spidev0.0 under
+ * /dev, or of a network interface */
+#define HWE_MAX_NODE_NAME	31
+
+/*! Maximum length of the label of a device, e.g. the name of its
+ * section in a configuration file */
+#define HWE_MAX_LABEL	63
+
 /*! Maximum number of key-value pairs that can be added to a device */
 #define	HWE_MAX_PAIRS	1000
 
@@ -25,6 +33,14 @@
  */
 #define	HWE_MAX_DEVICES	256
 
+/*! Maximum number of network devices. Network devices aren't limited
+ * as above, and the endpoints they emulate count as devices too. */
+#define	HWE_MAX_NET_DEVICES	4096
+
+/*! Maximum number of I2C devices. Only the adapters are limited as
+ * above; the clients on them count as devices too. */
+#define	HWE_MAX_I2C_DEVICES	1024
+
 /*! Currently supported device types.
     Start adding new interfaces from here. */
 #define HWE_FOREACH_IFACE(D) \
@@ -42,4 +58,9 @@ enum HWE_IFACE {
 };
 #undef DEFINE_IFACE
 
+/*! Maximum number of devices of the interface \a iface */
+#define HWE_MAX_IFACE_DEVICES(iface) \
+	((iface) == HWE_NET ? HWE_MAX_NET_DEVICES : \
+	 (iface) == HWE_I2C ? HWE_MAX_I2C_DEVICES : HWE_MAX_DEVICES)
+
 #endif /* HWE_CONSTS_H_INCLUDED */
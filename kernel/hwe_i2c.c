@@ -9,63 +9,450 @@
 #include <linux/slab.h>
 #include <linux/i2c.h>
 #include <linux/printk.h>
+#include <linux/version.h>
+#include <linux/hashtable.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/jiffies.h>
+#include <linux/sysfs.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/kmod.h>
+#include <linux/wait.h>
 
 #include "hwemu.h"
 
+/*! Default (and minimum) size of the register image of a chip */
 #define I2C_CHIP_SIZE	256
 
+/*! Maximum size of the register image: 24-bit addresses */
+#define I2C_CHIP_MAX_SIZE	(1 << 24)
+
 #define I2C_FUNCTIONALITY \
 	(I2C_FUNC_SMBUS_QUICK | I2C_FUNC_SMBUS_BYTE | \
 	 I2C_FUNC_SMBUS_BYTE_DATA | I2C_FUNC_SMBUS_WORD_DATA | \
-	 I2C_FUNC_SMBUS_I2C_BLOCK | I2C_FUNC_SMBUS_BLOCK_DATA)
+	 I2C_FUNC_SMBUS_I2C_BLOCK | I2C_FUNC_SMBUS_BLOCK_DATA | \
+	 I2C_FUNC_10BIT_ADDR)
+
+/*! Marks a 10-bit client address */
+#define I2C_CLIENT_ADDR_TEN	0x8000
+
+/*! Default bus speed: standard mode */
+#define I2C_DEFAULT_SPEED_HZ	100000
+
+/*! Minimum bus speed, as SMBus allows; a slower bus would only
+ * stall the clients */
+#define I2C_MIN_SPEED_HZ	10000
+
+/*! Maximum bus speed: ultra fast mode */
+#define I2C_MAX_SPEED_HZ	5000000
+
+/*! Above fast mode plus, i.e. in high-speed mode, transactions begin
+ * with the master code, which is sent in fast mode. */
+#define I2C_FAST_SPEED_HZ	400000
+#define I2C_FAST_PLUS_SPEED_HZ	1000000
+
+/*! Maximum clock stretching per data byte: 1 ms */
+#define I2C_MAX_STRETCH_NS	NSEC_PER_MSEC
 
-/*! \brief Virtual "chip" accessed via I2C. */
+/*! log2 of the size of the client hash table of an adapter */
+#define I2C_CLIENT_HASH_BITS	6
+
+/*! \brief Virtual "chip" accessed via I2C.
+ *
+ * The size of the register image is a power of 2, so that the
+ * addresses simply wrap around. The image is allocated with
+ * vmalloc_user() to be mapped by userspace (see store_mmap()). */
 struct hwe_chip {
-	u8 pos;
-	u8 dat[I2C_CHIP_SIZE];
+	unsigned pos;
+	unsigned size;
+	u8 * dat;
 };
 
-/*! Private data for the I2C device. */
+/*! Private data for the I2C device.
+ *
+ * A device is either an adapter or a client of an adapter (its
+ * parent): a chip at an address of its own, with its own pairs,
+ * pending response and register image. The adapter answers at the
+ * addresses none of its clients has.
+ */
 struct hwe_dev_priv {
 	bool in_use;
+	/* The transfers take the lock of the adapter instead of the
+	 * interface lock; it guards the state of the adapter and of its
+	 * clients (see state_lock()) */
+	spinlock_t lock;
 	struct hwe_dev * hwedev;
-	struct i2c_adapter adapter;
 	long index;
-	u8 resp[HWE_MAX_RESPONSE];
-	u8 * resp_ptr;
-	size_t resp_size;
+	struct hwe_resp resp;
 	struct hwe_chip chip;
+	/* settings */
+	bool regmap;
+	unsigned addr_width;
+	unsigned page_size;
+	unsigned stretch_ns;	/* clock stretching per data byte */
+	bool timing;		/* adapters only */
+	unsigned bus_speed_hz;	/* adapters only */
+	/* The last timer response, copied into the register image only
+	 * when its part of the image is accessed (see sync_store()) */
+	struct hwe_pair * store_pair;
+	bool store_stale;	/* not copied yet */
+	bool store_dirty;	/* its part of the image written since */
+	bool store_mapped;	/* userspace may see the image directly */
+	unsigned long store_map_pg;	/* a page mapped, last we checked */
+	unsigned long store_map_scan;	/* jiffies of the last full check */
+	unsigned long store_updates;
+	unsigned long store_copies;
+	bool is_client;
+	/* clients only */
+	struct hwe_dev_priv * parent;	/* NULL once the adapter is gone */
+	u16 addr;	/* with I2C_CLIENT_ADDR_TEN if 10-bit */
+	struct hlist_node client;
+	/* adapters only */
+	struct i2c_adapter adapter;
 	struct list_head devices;
-	bool async;
+	DECLARE_HASHTABLE(clients, I2C_CLIENT_HASH_BITS);
+	unsigned client_count;
+	/* The transfers in progress, which look at the clients without
+	 * the lock; a client isn't freed until they are over */
+	unsigned xfers;
+	wait_queue_head_t idle;
 };
 
 #define to_priv(adap) container_of(adap, struct hwe_dev_priv, adapter)
 
 static struct list_head devices;
 
+/* the i2c-dev driver has been requested (see new_adapter()) */
+static bool i2c_dev_requested;
+
 #define NODEV_ERROR ENODEV
 
-static int do_master_xfer(struct i2c_adapter * adap, struct i2c_msg * msgs, int num)
+/* Returns the client of the adapter \a dev at \a addr, or the adapter
+ * itself if there is none. \a ten tells a 10-bit address. */
+static struct hwe_dev_priv * find_client(struct hwe_dev_priv * dev, u16 addr,
+	bool ten)
 {
-	struct hwe_dev_priv * dev = to_priv(adap);
+	struct hwe_dev_priv * c;
+
+	if (!dev->client_count)
+		return dev;
+
+	if (ten)
+		addr |= I2C_CLIENT_ADDR_TEN;
+
+	hash_for_each_possible (dev->clients, c, client, addr)
+		if (c->addr == addr)
+			return c;
+
+	return dev;
+}
+
+/* Returns the lock guarding the state of \a dev: that of its adapter,
+ * or its own if it is an adapter or a client without one. */
+static spinlock_t * state_lock(struct hwe_dev_priv * dev)
+{
+	return dev->parent ? &dev->parent->lock : &dev->lock;
+}
+
+/* Tells whether userspace still maps a page of the register image.
+ * A binary sysfs attribute can't have a close() callback for its
+ * mappings (kernfs_fop_mmap() refuses vm_ops with one), so there is no
+ * telling when they go away; the pages are looked at instead. Only the
+ * page found mapped the last time is checked on every call; once it is
+ * gone, the other pages are scanned at most once a second, and the
+ * image is taken as mapped in between. */
+static bool store_still_mapped(struct hwe_dev_priv * dev)
+{
+	unsigned long pages = DIV_ROUND_UP(dev->chip.size, PAGE_SIZE);
+	unsigned long i, pg;
+
+	if (page_mapped(vmalloc_to_page(dev->chip.dat +
+	    (dev->store_map_pg % pages) * PAGE_SIZE)))
+		return true;
+
+	if (time_before(jiffies, dev->store_map_scan + HZ))
+		return true;
+
+	dev->store_map_scan = jiffies;
+
+	for (i = 1; i < pages; i++) {
+		pg = (dev->store_map_pg + i) % pages;
+
+		if (page_mapped(vmalloc_to_page(dev->chip.dat + pg * PAGE_SIZE))) {
+			dev->store_map_pg = pg;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Copies the last timer response into the register image if it
+ * hasn't been copied yet and the \a len bytes at \a pos (wrapping
+ * around) are part of it. Must be called before those bytes are
+ * accessed; \a write tells whether they are about to change. */
+static void sync_store(struct hwe_dev_priv * dev, unsigned pos, unsigned len,
+	bool write)
+{
+	struct hwe_chip * chip = &dev->chip;
+	unsigned n;
+
+	if (!dev->store_pair)
+		return;
+
+	n = min_t(size_t, dev->store_pair->resp_size, chip->size);
+
+	if (pos >= n && pos + len <= chip->size)
+		return;
+
+	if (dev->store_stale) {
+		memcpy(chip->dat, dev->store_pair->resp, n);
+		dev->store_stale = false;
+		dev->store_dirty = false;
+		dev->store_copies++;
+	}
+
+	if (write)
+		dev->store_dirty = true;
+}
+
+/* The register map personality: the first addr_width bytes written
+ * (most significant first) select a register of the chip, the following
+ * ones are stored from there on, and reads go on from the current
+ * register, like EEPROMs do. Writes wrap around within a page of
+ * page_size bytes, reads wrap around the whole chip. No pairs are
+ * involved. Must be called under the lock of the adapter, as the image
+ * may be resized, i.e. freed, meanwhile. */
+static void regmap_xfer(struct hwe_dev_priv * dev, struct i2c_msg * m)
+{
+	struct hwe_chip * chip = &dev->chip;
+	unsigned mask = chip->size - 1;
+	unsigned len = m->len;
+	u8 * buf = m->buf;
+	unsigned i, n;
+	/* the settings may be changed during the transfer; take each
+	 * one once */
+	unsigned width = READ_ONCE(dev->addr_width);
+	unsigned page_size = READ_ONCE(dev->page_size);
+
+	if (m->flags & I2C_M_RD) {
+		sync_store(dev, chip->pos, len, false);
+
+		for (i = 0; i < len; i += n) {
+			n = min(len - i, chip->size - chip->pos);
+			memcpy(buf + i, chip->dat + chip->pos, n);
+			chip->pos = (chip->pos + n) & mask;
+		}
+	}
+	else {
+		unsigned page = page_size && page_size < chip->size ?
+			page_size : chip->size;
+
+		/* e.g. an ACK poll; the address is incomplete */
+		if (len < width)
+			return;
+
+		if (width) {
+			unsigned addr = 0;
+
+			for (i = 0; i < width; i++)
+				addr = addr << 8 | buf[i];
+
+			chip->pos = addr & mask;
+			buf += width;
+			len -= width;
+		}
+
+		/* a write wrapping around its page may touch all of it */
+		if (len > page - (chip->pos & (page - 1)))
+			sync_store(dev, chip->pos & ~(page - 1), page, true);
+		else
+			sync_store(dev, chip->pos, len, true);
+
+		for (i = 0; i < len; i += n) {
+			unsigned base = chip->pos & ~(page - 1);
+			unsigned off = chip->pos - base;
+
+			n = min(len - i, page - off);
+			memcpy(chip->dat + chip->pos, buf + i, n);
+			chip->pos = base + ((off + n) & (page - 1));
+		}
+	}
+}
+
+/* Returns the time a transaction takes on the bus of the adapter
+ * \a dev: \a bytes bytes, including the address bytes, each followed
+ * by an ACK bit, and \a starts start conditions (the first one and
+ * the repeated ones) plus a stop condition, counted as a bit each.
+ * Clock stretching is up to the caller. */
+static u64 bus_time_ns(struct hwe_dev_priv * dev, unsigned bytes, unsigned starts)
+{
+	unsigned speed_hz = READ_ONCE(dev->bus_speed_hz);
+	u64 ns;
+
+	if (!speed_hz)
+		return 0;
+
+	ns = div_u64(((u64)bytes * 9 + starts + 1) * NSEC_PER_SEC, speed_hz);
+
+	/* the master code: a start condition, a byte and a NACK */
+	if (speed_hz > I2C_FAST_PLUS_SPEED_HZ)
+		ns += div_u64(10 * NSEC_PER_SEC, I2C_FAST_SPEED_HZ);
+
+	return ns;
+}
+
+/* Returns the number of bytes of an SMBus transfer on the bus,
+ * including the address bytes, and sets \a starts to the number of
+ * start conditions. \a len is the length of a block. */
+static unsigned smbus_bytes(char read_write, int size, unsigned len,
+	unsigned * starts)
+{
+	unsigned n;
+
+	*starts = 1;
+
+	switch (size) {
+		case I2C_SMBUS_QUICK:
+			return 1;
+		case I2C_SMBUS_BYTE:
+			return 2;
+		case I2C_SMBUS_BYTE_DATA:
+			n = 1;
+			break;
+		case I2C_SMBUS_WORD_DATA:
+			n = 2;
+			break;
+		case I2C_SMBUS_BLOCK_DATA:
+			/* the byte count comes first */
+			n = 1 + len;
+			break;
+		case I2C_SMBUS_I2C_BLOCK_DATA:
+			n = len;
+			break;
+		default:
+			return 0;
+	}
+
+	/* address, command and, for a read, a repeated start with the
+	 * address again before the data */
+	if (read_write == I2C_SMBUS_READ) {
+		*starts = 2;
+		return 3 + n;
+	}
+
+	return 2 + n;
+}
+
+/* Marks a transfer in progress on the adapter \a dev, unless the
+ * adapter has been marked unused, to be removed. The transfer takes
+ * the lock only to look at the state of the adapter and its clients;
+ * the clients aren't freed until it is over (see wait_xfers()). */
+static bool begin_xfer(struct hwe_dev_priv * dev)
+{
+	bool ret;
+
+	spin_lock_bh(&dev->lock);
+
+	if ((ret = dev->in_use))
+		dev->xfers++;
+
+	spin_unlock_bh(&dev->lock);
+
+	return ret;
+}
+
+static void end_xfer(struct hwe_dev_priv * dev)
+{
+	spin_lock_bh(&dev->lock);
+
+	/* under the lock, so that the waiter is done with the device
+	 * only once we are */
+	if (!--dev->xfers)
+		wake_up(&dev->idle);
+
+	spin_unlock_bh(&dev->lock);
+}
+
+static bool no_xfers(struct hwe_dev_priv * dev)
+{
+	bool ret;
+
+	spin_lock_bh(&dev->lock);
+	ret = !dev->xfers;
+	spin_unlock_bh(&dev->lock);
+
+	return ret;
+}
+
+/* Waits for the transfers in progress on the adapter \a dev, which
+ * has been marked unused, or whose client has been removed. */
+static void wait_xfers(struct hwe_dev_priv * dev)
+{
+	wait_event(dev->idle, no_xfers(dev));
+}
+
+/* \a delay_ns is set to the time the transfer takes on a real bus. */
+static int do_master_xfer(struct i2c_adapter * adap, struct i2c_msg * msgs, int num,
+	u64 * delay_ns)
+{
+	struct hwe_dev_priv * adapter = to_priv(adap);
+	spinlock_t * lock = &adapter->lock;
+	unsigned bytes = 0;
+	unsigned starts = 0;
+	u64 stretch_ns = 0;
 	int err = num;
 	int i;
 
 	for (i = 0; i < num; i++) {
 		struct i2c_msg * m = &msgs[i];
+		struct hwe_dev_priv * dev;
+		struct hwe_pair * pair;
+		size_t pos, n;
+		bool pending;
+
+		spin_lock_bh(lock);
+		dev = find_client(adapter, m->addr, !!(m->flags & I2C_M_TEN));
+		spin_unlock_bh(lock);
+
+		/* a message may go on without a (repeated) start; a 10-bit
+		 * address takes two bytes, but a read after a repeated
+		 * start sends the first one only */
+		if (!i || !(m->flags & I2C_M_NOSTART)) {
+			starts++;
+			bytes += (m->flags & I2C_M_TEN) &&
+				(starts == 1 || !(m->flags & I2C_M_RD)) ? 2 : 1;
+		}
 
-		if (m->flags & I2C_M_RD) {
-			/* reading */
-			if (dev->resp_size) {
-				size_t sz = dev->resp_size > m->len ?
-					m->len : dev->resp_size;
+		bytes += m->len;
+		stretch_ns += (u64)READ_ONCE(dev->stretch_ns) * m->len;
+
+		if (READ_ONCE(dev->regmap)) {
+			spin_lock_bh(lock);
+			regmap_xfer(dev, m);
+			spin_unlock_bh(lock);
 
-				memcpy(m->buf, dev->resp_ptr, sz);
+			if (m->flags & I2C_M_RD)
+				hwe_log_response(HWE_I2C, dev->index, m->buf, m->len);
+			else
+				hwe_log_request(HWE_I2C, dev->index, m->buf, m->len, true);
+
+			continue;
+		}
 
-				/* VcpSdkCmd may read in chunks of sizes
-				 * less than resp_size. */
-				dev->resp_size -= sz;
-				dev->resp_ptr += sz;
+		if (m->flags & I2C_M_RD) {
+			/* reading; VcpSdkCmd may read in chunks of sizes
+			 * less than the response size */
+			spin_lock_bh(lock);
+			pair = hwe_resp_take(&dev->resp, m->len, &pos, &n);
+			spin_unlock_bh(lock);
+
+			if (pair) {
+				memcpy(m->buf, pair->resp + pos, n);
+				put_pair(pair);
 
 				hwe_log_response(HWE_I2C, dev->index, m->buf, m->len);
 			}
@@ -76,61 +463,74 @@ static int do_master_xfer(struct i2c_adapter * adap, struct i2c_msg * msgs, int
 			}
 		}
 		else {
-			/* writing */
-			struct hwe_pair * pair;
+			/* writing; the pairs may change while we search them */
+			rcu_read_lock();
 
 			pair = find_response(dev->hwedev, m->buf, m->len);
 
-			if (dev->resp_size && !dev->async)
+			if (pair && !try_get_pair(pair))
+				pair = NULL;
+
+			rcu_read_unlock();
+
+			spin_lock_bh(lock);
+
+			pending = hwe_resp_pending(&dev->resp) && !dev->resp.async;
+
+			if (pair)
+				hwe_resp_set(&dev->resp, pair, false);
+			else
+				hwe_resp_clear(&dev->resp);
+
+			spin_unlock_bh(lock);
+
+			if (pending)
 				dev_err_ratelimited(&adap->dev, "new request arrived "
 					"while previous one is pending; "
 					"possible data loss\n");
 
-			if (pair) {
-				memcpy(dev->resp, pair->resp, pair->resp_size);
-				dev->resp_size = pair->resp_size;
-				dev->resp_ptr = dev->resp;
-				dev->async = false;
-			}
-			else
-				dev->resp_size = 0;
-
 			hwe_log_request(HWE_I2C, dev->index, m->buf, m->len, !!pair);
+
+			if (pair)
+				put_pair(pair);
 		}
 	}
 
+	*delay_ns = READ_ONCE(adapter->timing) ?
+		bus_time_ns(adapter, bytes, starts) + stretch_ns : 0;
+
 	return err;
 }
 
 static int hwei2c_master_xfer(struct i2c_adapter * adap, struct i2c_msg * msgs, int num)
 {
 	struct hwe_dev_priv * dev = to_priv(adap);
-	int err = -NODEV_ERROR;
+	int err;
+	u64 delay_ns = 0;
 
-	/* If the transfer happens while the device is being removed,
-	 * and we use lock_iface_devs(), we may get into a deadlock
-	 * (somewhere in i2c_del_adapter()). In order to avoid this,
-	 * we mark the device as unused before removal and handle
-	 * the transfer only if the device is in use. */
-	if (dev->in_use) {
-		lock_iface_devs(HWE_I2C);
+	/* The I2C core serializes the transfers of an adapter, but not
+	 * those of different adapters, so the interface lock isn't taken
+	 * here. */
+	if (!begin_xfer(dev))
+		return -NODEV_ERROR;
 
-		err = do_master_xfer(adap, msgs, num);
+	err = do_master_xfer(adap, msgs, num, &delay_ns);
 
-		unlock_iface_devs(HWE_I2C);
-	}
+	end_xfer(dev);
+
+	/* the transfer completes when it would on a real bus */
+	if (delay_ns)
+		hwe_delay_ns(delay_ns);
 
 	return err;
 }
 
-static int do_smbus_xfer(struct i2c_adapter * adap, u16 addr, unsigned short flags,
-	char read_write, u8 command, int size, union i2c_smbus_data *data)
+/* Logs an SMBus transfer once it is over; \a pos is the current
+ * register before the transfer. */
+static void log_smbus_xfer(struct i2c_adapter * adap, u16 addr,
+	char read_write, u8 command, int size, union i2c_smbus_data *data,
+	unsigned pos)
 {
-	struct hwe_dev_priv * dev = to_priv(adap);
-	struct hwe_chip * chip = &dev->chip;
-	s32 err = 0;
-	int i, len;
-
 	switch (size) {
 
 		case I2C_SMBUS_QUICK:
@@ -141,41 +541,108 @@ static int do_smbus_xfer(struct i2c_adapter * adap, u16 addr, unsigned short fla
 
 		case I2C_SMBUS_BYTE:
 
-			if (read_write == I2C_SMBUS_WRITE) {
-				chip->pos = command;
+			if (read_write == I2C_SMBUS_WRITE)
 				dev_dbg(&adap->dev,
 					"I2C_SMBUS_BYTE: addr=0x%02x, set pos 0x%02x\n",
 					addr, command);
-			}
-			else {
-				data->byte = chip->dat[chip->pos];
+			else
 				dev_dbg(&adap->dev,
 					"I2C_SMBUS_BYTE: addr=0x%02x, read 0x%02x at 0x%02x\n",
-					addr, data->byte, chip->pos);
-				chip->pos++;
-			}
+					addr, data->byte, pos);
 
 			break;
 
 		case I2C_SMBUS_BYTE_DATA:
 
-			if (read_write == I2C_SMBUS_WRITE) {
-				chip->dat[command] = data->byte;
-
+			if (read_write == I2C_SMBUS_WRITE)
 				dev_dbg(&adap->dev,
 					"I2C_SMBUS_BYTE_DATA: addr=0x%02x, wrote 0x%02x at 0x%02x\n",
 					addr, data->byte, command);
-
-			}
-			else {
-				data->byte = chip->dat[command];
-
+			else
 				dev_dbg(&adap->dev,
 					"I2C_SMBUS_BYTE_DATA: addr=0x%02x, read  0x%02x at 0x%02x\n",
 					addr, data->byte, command);
+
+			break;
+
+		case I2C_SMBUS_WORD_DATA:
+
+			if (read_write == I2C_SMBUS_WRITE)
+				dev_dbg(&adap->dev,
+					"I2C_SMBUS_WORD_DATA: addr=0x%02x, wrote 0x%04x at 0x%02x\n",
+					addr, data->word, command);
+			else
+				dev_dbg(&adap->dev,
+					"I2C_SMBUS_WORD_DATA: addr=0x%02x, read 0x%04x at 0x%02x\n",
+					addr, data->word, command);
+
+			break;
+
+		case I2C_SMBUS_I2C_BLOCK_DATA:
+		case I2C_SMBUS_BLOCK_DATA:
+
+			dev_dbg(&adap->dev,
+				"I2C_SMBUS_%sBLOCK_DATA: addr=0x%02x, %s %d bytes at 0x%02x\n",
+				size == I2C_SMBUS_I2C_BLOCK_DATA ? "I2C_" : "", addr,
+				read_write == I2C_SMBUS_WRITE ? "wrote" : "read",
+				data->block[0], command);
+			break;
+
+		default:
+			dev_dbg(&adap->dev, "Unsupported I2C/SMBus command\n");
+			break;
+	}
+}
+
+/* \a delay_ns is set to the time the transfer takes on a real bus. */
+static int do_smbus_xfer(struct i2c_adapter * adap, u16 addr, unsigned short flags,
+	char read_write, u8 command, int size, union i2c_smbus_data *data,
+	u64 * delay_ns)
+{
+	struct hwe_dev_priv * adapter = to_priv(adap);
+	struct hwe_dev_priv * dev;
+	struct hwe_chip * chip;
+	unsigned pos;
+	s32 err = 0;
+	int i, len;
+
+	/* The register image may be resized, i.e. freed, meanwhile, so
+	 * it is accessed under the lock; the logging comes after. */
+	spin_lock_bh(&adapter->lock);
+
+	dev = find_client(adapter, addr, !!(flags & I2C_CLIENT_TEN));
+	chip = &dev->chip;
+	pos = chip->pos;
+
+	/* at most a block from the command, or a byte at the current
+	 * register */
+	sync_store(dev, size == I2C_SMBUS_BYTE ? chip->pos : command,
+		I2C_SMBUS_BLOCK_MAX + 1, read_write == I2C_SMBUS_WRITE);
+
+	switch (size) {
+
+		case I2C_SMBUS_QUICK:
+			break;
+
+		case I2C_SMBUS_BYTE:
+
+			if (read_write == I2C_SMBUS_WRITE)
+				chip->pos = command;
+			else {
+				data->byte = chip->dat[chip->pos];
+				chip->pos = (chip->pos + 1) & (chip->size - 1);
 			}
 
-			chip->pos = command + 1;
+			break;
+
+		case I2C_SMBUS_BYTE_DATA:
+
+			if (read_write == I2C_SMBUS_WRITE)
+				chip->dat[command] = data->byte;
+			else
+				data->byte = chip->dat[command];
+
+			chip->pos = (command + 1) & (chip->size - 1);
 
 			break;
 
@@ -187,20 +654,12 @@ static int do_smbus_xfer(struct i2c_adapter * adap, u16 addr, unsigned short fla
 					*(u16*)&chip->dat[command] = data->word;
 				else
 					chip->dat[command] = (u8)data->word;
-
-				dev_dbg(&adap->dev,
-					"I2C_SMBUS_WORD_DATA: addr=0x%02x, wrote 0x%04x at 0x%02x\n",
-					addr, data->word, command);
 			}
 			else {
 				/* XXX handle possible overrun */
 				data->word = (command < 0xFF) ?
 						*(u16*)&chip->dat[command] :
 						(u16)chip->dat[command];
-
-				dev_dbg(&adap->dev,
-					"I2C_SMBUS_WORD_DATA: addr=0x%02x, read 0x%04x at 0x%02x\n",
-					addr, data->word, command);
 			}
 
 			break;
@@ -212,8 +671,8 @@ static int do_smbus_xfer(struct i2c_adapter * adap, u16 addr, unsigned short fla
 			if (data->block[0] > I2C_SMBUS_BLOCK_MAX)
 				data->block[0] = I2C_SMBUS_BLOCK_MAX;
 
-			if (data->block[0] > I2C_CHIP_SIZE - command)
-				data->block[0] = I2C_CHIP_SIZE - command;
+			if (data->block[0] > chip->size - command)
+				data->block[0] = chip->size - command;
 
 			len = data->block[0];
 
@@ -221,30 +680,42 @@ static int do_smbus_xfer(struct i2c_adapter * adap, u16 addr, unsigned short fla
 				for (i = 0; i < len; i++) {
 					chip->dat[command + i] = data->block[1 + i];
 				}
-
-				dev_dbg(&adap->dev,
-					"I2C_SMBUS_%sBLOCK_DATA: addr=0x%02x, wrote %d bytes at 0x%02x\n",
-					size == I2C_SMBUS_I2C_BLOCK_DATA ? "I2C_" : "", addr, len, command);
 			}
 			else {
 				for (i = 0; i < len; i++) {
 					data->block[1 + i] =
 						chip->dat[command + i];
 				}
-
-				dev_dbg(&adap->dev,
-					"I2C_SMBUS_%sBLOCK_DATA: addr=0x%02x, read %d bytes at 0x%02x\n",
-					size == I2C_SMBUS_I2C_BLOCK_DATA ? "I2C_" : "", addr, len, command);
 			}
 
 			break;
 
 		default:
-			dev_dbg(&adap->dev, "Unsupported I2C/SMBus command\n");
 			err = -EOPNOTSUPP;
 			break;
 	}
 
+	spin_unlock_bh(&adapter->lock);
+
+	log_smbus_xfer(adap, addr, read_write, command, size, data, pos);
+
+	if (!err && READ_ONCE(adapter->timing)) {
+		unsigned starts;
+		unsigned bytes = smbus_bytes(read_write, size,
+			size == I2C_SMBUS_BLOCK_DATA ||
+			size == I2C_SMBUS_I2C_BLOCK_DATA ? data->block[0] : 0,
+			&starts);
+		/* the address bytes aren't stretched; the second byte of
+		 * a 10-bit address is sent after the first start only, as
+		 * the repeated start, if any, is followed by a read */
+		unsigned addr_bytes = starts + !!(flags & I2C_CLIENT_TEN);
+
+		bytes += !!(flags & I2C_CLIENT_TEN);
+
+		*delay_ns = bus_time_ns(adapter, bytes, starts) +
+			(u64)READ_ONCE(dev->stretch_ns) * (bytes - addr_bytes);
+	}
+
 	return err;
 }
 
@@ -252,16 +723,19 @@ static int hwei2c_smbus_xfer(struct i2c_adapter * adap, u16 addr, unsigned short
 	char read_write, u8 command, int size, union i2c_smbus_data *data)
 {
 	struct hwe_dev_priv * dev = to_priv(adap);
-	int err = -NODEV_ERROR;
+	int err;
+	u64 delay_ns = 0;
 
-	if (dev->in_use) {
-		lock_iface_devs(HWE_I2C);
+	if (!begin_xfer(dev))
+		return -NODEV_ERROR;
 
-		err = do_smbus_xfer(adap, addr, flags, read_write,
-			command, size, data);
+	err = do_smbus_xfer(adap, addr, flags, read_write,
+		command, size, data, &delay_ns);
 
-		unlock_iface_devs(HWE_I2C);
-	}
+	end_xfer(dev);
+
+	if (delay_ns)
+		hwe_delay_ns(delay_ns);
 
 	return err;
 }
@@ -279,14 +753,324 @@ static const struct i2c_algorithm smbus_algorithm = {
 	.functionality	= hwei2c_func,
 };
 
+static ssize_t store_size_show(struct hwe_dev * hwedev,
+	struct dev_attribute * attr, char * buf)
+{
+	ssize_t ret;
+
+	lock_devs(hwedev);
+	ret = sprintf(buf, "%u", hwe_get_dev_priv(hwedev)->chip.size);
+	unlock_devs(hwedev);
+
+	return ret;
+}
+
+/* Resizing keeps the contents that still fit. */
+static ssize_t store_size_store(struct hwe_dev * hwedev,
+	struct dev_attribute * attr, const char * buf, size_t count)
+{
+	struct hwe_dev_priv * dev;
+	struct hwe_chip * chip;
+	unsigned size;
+	u8 * dat;
+
+	if (kstrtouint(buf, 0, &size) || !is_power_of_2(size) ||
+	    size < I2C_CHIP_SIZE || size > I2C_CHIP_MAX_SIZE)
+		return -EINVAL;
+
+	if (!(dat = vmalloc_user(size)))
+		return -ENOMEM;
+
+	lock_devs(hwedev);
+
+	dev = hwe_get_dev_priv(hwedev);
+	chip = &dev->chip;
+
+	spin_lock_bh(state_lock(dev));
+
+	sync_store(dev, 0, chip->size, false);
+	memcpy(dat, chip->dat, min(size, chip->size));
+	swap(dat, chip->dat);
+	chip->size = size;
+	chip->pos &= size - 1;
+	/* the old image is still mapped, if at all */
+	dev->store_mapped = false;
+
+	spin_unlock_bh(state_lock(dev));
+
+	unlock_devs(hwedev);
+
+	vfree(dat);
+
+	return count;
+}
+
+static ssize_t page_size_show(struct hwe_dev * hwedev,
+	struct dev_attribute * attr, char * buf)
+{
+	ssize_t ret;
+
+	lock_devs(hwedev);
+	ret = sprintf(buf, "%u", hwe_get_dev_priv(hwedev)->page_size);
+	unlock_devs(hwedev);
+
+	return ret;
+}
+
+static ssize_t page_size_store(struct hwe_dev * hwedev,
+	struct dev_attribute * attr, const char * buf, size_t count)
+{
+	unsigned val;
+
+	if (kstrtouint(buf, 0, &val) || (val && !is_power_of_2(val)) ||
+	    val > I2C_CHIP_MAX_SIZE)
+		return -EINVAL;
+
+	lock_devs(hwedev);
+	/* read without the lock by the transfers */
+	WRITE_ONCE(hwe_get_dev_priv(hwedev)->page_size, val);
+	unlock_devs(hwedev);
+
+	return count;
+}
+
+/* The callbacks of binary attributes take a const attribute since 6.13;
+ * from 6.13 to 6.16, those are the _new ones. */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0))
+#define BIN_ATTR_CONST	const
+#else
+#define BIN_ATTR_CONST
+#endif
+
+/* The register image as the binary file `store`. Reading or writing
+ * it is as good as a bulk transfer, with no transfer involved. */
+static ssize_t store_read(struct file * file, struct kobject * kobj,
+	BIN_ATTR_CONST struct bin_attribute * attr, char * buf, loff_t off,
+	size_t count)
+{
+	struct hwe_dev * hwedev = hwe_kobj_to_dev(kobj);
+	struct hwe_dev_priv * dev;
+	struct hwe_chip * chip;
+
+	lock_devs(hwedev);
+
+	dev = hwe_get_dev_priv(hwedev);
+	chip = &dev->chip;
+
+	spin_lock_bh(state_lock(dev));
+
+	if (off >= chip->size)
+		count = 0;
+	else {
+		count = min_t(size_t, count, chip->size - off);
+		sync_store(dev, off, count, false);
+		memcpy(buf, chip->dat + off, count);
+	}
+
+	spin_unlock_bh(state_lock(dev));
+
+	unlock_devs(hwedev);
+
+	return count;
+}
+
+static ssize_t store_write(struct file * file, struct kobject * kobj,
+	BIN_ATTR_CONST struct bin_attribute * attr, char * buf, loff_t off,
+	size_t count)
+{
+	struct hwe_dev * hwedev = hwe_kobj_to_dev(kobj);
+	struct hwe_dev_priv * dev;
+	struct hwe_chip * chip;
+	ssize_t ret;
+
+	lock_devs(hwedev);
+
+	dev = hwe_get_dev_priv(hwedev);
+	chip = &dev->chip;
+
+	spin_lock_bh(state_lock(dev));
+
+	if (off >= chip->size)
+		ret = -EFBIG;
+	else {
+		ret = min_t(size_t, count, chip->size - off);
+		sync_store(dev, off, ret, true);
+		memcpy(chip->dat + off, buf, ret);
+	}
+
+	spin_unlock_bh(state_lock(dev));
+
+	unlock_devs(hwedev);
+
+	return ret;
+}
+
+/* A mapping shows the register image as it is at the time of mmap();
+ * it doesn't follow a change of store_size. The timer responses are
+ * copied into a mapped image right away, as there is no telling when
+ * userspace reads it, until it is unmapped (see store_still_mapped()). */
+static int store_mmap(struct file * file, struct kobject * kobj,
+	BIN_ATTR_CONST struct bin_attribute * attr, struct vm_area_struct * vma)
+{
+	struct hwe_dev * hwedev = hwe_kobj_to_dev(kobj);
+	struct hwe_dev_priv * dev;
+	int err;
+
+	lock_devs(hwedev);
+
+	dev = hwe_get_dev_priv(hwedev);
+	err = remap_vmalloc_range(vma, dev->chip.dat, vma->vm_pgoff);
+
+	if (!err) {
+		spin_lock_bh(state_lock(dev));
+		dev->store_mapped = true;
+		dev->store_map_pg = vma->vm_pgoff;
+		dev->store_map_scan = jiffies - HZ;
+		sync_store(dev, 0, dev->chip.size, false);
+		spin_unlock_bh(state_lock(dev));
+	}
+
+	unlock_devs(hwedev);
+
+	return err;
+}
+
+static BIN_ATTR_CONST struct bin_attribute hwe_attr_store = {
+	.attr = { .name = "store", .mode = 0664 },
+	/* the size varies; see store_size */
+	.size = 0,
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)) && \
+    (LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0))
+	.read_new = store_read,
+	.write_new = store_write,
+#else
+	.read = store_read,
+	.write = store_write,
+#endif
+	.mmap = store_mmap,
+};
+
+static BIN_ATTR_CONST struct bin_attribute * BIN_ATTR_CONST i2c_dev_bin_attrs[] = {
+	&hwe_attr_store,
+	NULL
+};
+
+/* How many timer responses were received and how many of them were
+ * actually copied into the register image. */
+static ssize_t store_counters_show(struct hwe_dev * hwedev,
+	struct dev_attribute * attr, char * buf)
+{
+	struct hwe_dev_priv * dev;
+	ssize_t ret;
+
+	lock_devs(hwedev);
+
+	dev = hwe_get_dev_priv(hwedev);
+	ret = sprintf(buf, "updates %lu\ncopies %lu\nsaved %lu\n",
+		dev->store_updates, dev->store_copies,
+		dev->store_updates - dev->store_copies);
+
+	unlock_devs(hwedev);
+
+	return ret;
+}
+
+HWE_DEV_ATTR_UINT(regmap, 1);
+HWE_DEV_ATTR_UINT(addr_width, 3);
+HWE_DEV_ATTR_RW(store_size);
+HWE_DEV_ATTR_RW(page_size);
+HWE_DEV_ATTR_RO(store_counters);
+HWE_DEV_ATTR_UINT(stretch_ns, I2C_MAX_STRETCH_NS);
+HWE_DEV_ATTR_UINT(timing, 1);
+HWE_DEV_ATTR_UINT_RANGE(bus_speed_hz, I2C_MIN_SPEED_HZ, I2C_MAX_SPEED_HZ);
+
+static struct attribute * i2c_dev_attrs[] = {
+	&hwe_attr_regmap.attr,
+	&hwe_attr_addr_width.attr,
+	&hwe_attr_store_size.attr,
+	&hwe_attr_page_size.attr,
+	&hwe_attr_store_counters.attr,
+	&hwe_attr_stretch_ns.attr,
+	&hwe_attr_timing.attr,
+	&hwe_attr_bus_speed_hz.attr,
+	NULL
+};
+
+/* The bus settings belong to the adapter. */
+static umode_t i2c_dev_attr_visible(struct kobject * kobj,
+	struct attribute * attr, int n)
+{
+	struct hwe_dev_priv * dev = hwe_get_dev_priv(hwe_kobj_to_dev(kobj));
+
+	if (dev->is_client && (attr == &hwe_attr_timing.attr ||
+	    attr == &hwe_attr_bus_speed_hz.attr))
+		return 0;
+
+	return attr->mode;
+}
+
+static const struct attribute_group i2c_dev_group = {
+	.attrs = i2c_dev_attrs,
+	.is_visible = i2c_dev_attr_visible,
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)) && \
+    (LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0))
+	.bin_attrs_new = i2c_dev_bin_attrs,
+#else
+	.bin_attrs = i2c_dev_bin_attrs,
+#endif
+};
+
+/*! Settings of I2C devices */
+const struct attribute_group * hwe_i2c_dev_groups[] = {
+	&i2c_dev_group,
+	NULL
+};
+
+/* Sets up the default register image and settings of a device. */
+static bool init_chip(struct hwe_dev_priv * dev)
+{
+	if (!(dev->chip.dat = vmalloc_user(I2C_CHIP_SIZE)))
+		return false;
+
+	dev->chip.size = I2C_CHIP_SIZE;
+	dev->chip.pos = 0;
+	dev->regmap = false;
+	dev->addr_width = 1;
+	dev->page_size = 0;
+	dev->stretch_ns = 0;
+	dev->timing = false;
+	dev->bus_speed_hz = I2C_DEFAULT_SPEED_HZ;
+	dev->store_pair = NULL;
+	dev->store_stale = false;
+	dev->store_dirty = false;
+	dev->store_mapped = false;
+	dev->store_map_pg = 0;
+	dev->store_map_scan = 0;
+	dev->store_updates = 0;
+	dev->store_copies = 0;
+
+	return true;
+}
+
+static void free_chip(struct hwe_dev_priv * dev)
+{
+	if (dev->store_pair)
+		put_pair(dev->store_pair);
+
+	dev->store_pair = NULL;
+	vfree(dev->chip.dat);
+	dev->chip.dat = NULL;
+}
+
 static void init_dev(struct hwe_dev_priv * dev, struct hwe_dev * hwedev,
 	long index)
 {
 	dev->in_use = true;
 	dev->hwedev = hwedev;
 	dev->index = index;
-	dev->resp_size = 0;
-	memset(&dev->chip, 0, sizeof(dev->chip));
+	hwe_resp_clear(&dev->resp);
+	hash_init(dev->clients);
+	dev->client_count = 0;
 	dev->adapter.owner = THIS_MODULE;
 	dev->adapter.class = I2C_CLASS_HWMON | I2C_CLASS_SPD;
 	dev->adapter.algo = &smbus_algorithm;
@@ -309,8 +1093,22 @@ static struct hwe_dev_priv * alloc_dev(struct hwe_dev * hwedev, long index)
 	struct hwe_dev_priv * ret = find_unused_dev();
 	bool is_new = !ret;
 
-	if (is_new && !(ret = kzalloc(sizeof(*ret), GFP_KERNEL)))
-		return ret;
+	if (is_new) {
+		if (!(ret = kzalloc(sizeof(*ret), GFP_KERNEL)))
+			return NULL;
+
+		/* once for all: a removed adapter is reused only once its
+		 * transfers are over (see wait_xfers()), but a late one
+		 * may still find it unused */
+		spin_lock_init(&ret->lock);
+		init_waitqueue_head(&ret->idle);
+	}
+
+	if (!init_chip(ret)) {
+		if (is_new)
+			kfree(ret);
+		return NULL;
+	}
 
 	init_dev(ret, hwedev, index);
 
@@ -323,21 +1121,44 @@ static struct hwe_dev_priv * alloc_dev(struct hwe_dev * hwedev, long index)
 static void del_dev(struct hwe_dev_priv * dev)
 {
 	list_del(&dev->devices);
+	free_chip(dev);
 	kfree(dev);
 }
 
-/*! Create an instance of the I2C device.
- */
-struct hwe_dev_priv * hwe_create_i2c_device(struct hwe_dev * hwedev, long index)
+/* Returns the number of adapters in use (clients aren't on the list). */
+static unsigned adapter_count(void)
+{
+	struct hwe_dev_priv * dev;
+	unsigned count = 0;
+
+	list_for_each_entry (dev, &devices, devices)
+		if (dev->in_use)
+			count++;
+
+	return count;
+}
+
+static struct hwe_dev_priv * new_adapter(struct hwe_dev * hwedev, long index)
 {
 	struct hwe_dev_priv * dev = NULL;
 	int err;
 
-	if (index < 0 || index >= HWE_MAX_DEVICES)
+	/* The nodes of the adapters (/dev/i2c-N) are created by the
+	 * i2c-dev driver, which is loaded along with the first adapter.
+	 * It may be built in, or not available at all; if it fails to
+	 * load, it is tried again with the next adapter. */
+	if (!i2c_dev_requested)
+		i2c_dev_requested = !request_module("i2c-dev");
+
+	if (index < 0 || index >= HWE_MAX_IFACE_DEVICES(HWE_I2C))
 		/* can't happen? */
 		pr_err("%s%ld: device not created; index out of range!\n",
 			iface_to_str(HWE_I2C), index);
 	else
+	if (adapter_count() >= HWE_MAX_DEVICES)
+		pr_err("%s%ld: device not created; too many adapters (max %d)\n",
+			iface_to_str(HWE_I2C), index, HWE_MAX_DEVICES);
+	else
 	if (!(dev = alloc_dev(hwedev, index)))
 		pr_err("%s%ld: device not created; out of memory!\n",
 			iface_to_str(HWE_I2C), index);
@@ -352,14 +1173,205 @@ struct hwe_dev_priv * hwe_create_i2c_device(struct hwe_dev * hwedev, long index)
 	return dev;
 }
 
+/* Clients have no adapter of their own, so they aren't kept on the
+ * list of devices for reuse. */
+static struct hwe_dev_priv * new_client(struct hwe_dev * hwedev, long index,
+	struct hwe_dev_priv * parent, u16 addr)
+{
+	struct hwe_dev_priv * dev;
+	bool ten = !!(addr & I2C_CLIENT_ADDR_TEN);
+
+	if (find_client(parent, addr & ~I2C_CLIENT_ADDR_TEN, ten) != parent) {
+		pr_err("%s%ld: device not created; %s%ld already has a client at 0x%x\n",
+			iface_to_str(HWE_I2C), index, iface_to_str(HWE_I2C),
+			parent->index, addr & ~I2C_CLIENT_ADDR_TEN);
+		return NULL;
+	}
+
+	if (!(dev = kzalloc(sizeof(*dev), GFP_KERNEL)) || !init_chip(dev)) {
+		pr_err("%s%ld: device not created; out of memory!\n",
+			iface_to_str(HWE_I2C), index);
+		kfree(dev);
+		return NULL;
+	}
+
+	dev->in_use = true;
+	dev->hwedev = hwedev;
+	dev->index = index;
+	hwe_resp_clear(&dev->resp);
+	/* used only once the adapter is gone */
+	spin_lock_init(&dev->lock);
+	dev->is_client = true;
+	dev->parent = parent;
+	dev->addr = addr;
+
+	spin_lock_bh(&parent->lock);
+	hash_add(parent->clients, &dev->client, addr);
+	parent->client_count++;
+	spin_unlock_bh(&parent->lock);
+
+	return dev;
+}
+
+/* Returns the adapter (not a client) named \a name, e.g. i2c0. */
+static struct hwe_dev_priv * find_adapter(const char * name)
+{
+	struct hwe_dev_priv * dev;
+
+	list_for_each_entry (dev, &devices, devices) {
+		char s[32];
+
+		snprintf(s, sizeof(s), "%s%ld", iface_to_str(HWE_I2C), dev->index);
+
+		if (dev->in_use && strcmp(s, name) == 0)
+			return dev;
+	}
+
+	return NULL;
+}
+
+/*! Create an instance of the I2C device.
+ *
+ * With the options `parent=`*adapter* and `addr=`*address* (plus
+ * `ten` for a 10-bit address), a client of the adapter *adapter*
+ * is created instead.
+ */
+struct hwe_dev_priv * hwe_create_i2c_device(struct hwe_dev * hwedev, long index,
+	const char * options)
+{
+	struct hwe_dev_priv * parent = NULL;
+	bool has_addr = false;
+	bool ten = false;
+	u16 addr = 0;
+	char name[16];
+	char value[32];
+	const char * s = options;
+
+	while (!!(s = hwe_next_option(s, name, sizeof(name), value, sizeof(value)))) {
+		if (strcmp(name, "parent") == 0) {
+			if (!(parent = find_adapter(value))) {
+				pr_err("%s%ld: device not created; no adapter %s\n",
+					iface_to_str(HWE_I2C), index, value);
+				return NULL;
+			}
+		}
+		else
+		if (strcmp(name, "addr") == 0) {
+			if (kstrtou16(value, 0, &addr)) {
+				pr_err("%s%ld: device not created; invalid address: %s\n",
+					iface_to_str(HWE_I2C), index, value);
+				return NULL;
+			}
+
+			has_addr = true;
+		}
+		else
+		if (strcmp(name, "ten") == 0)
+			ten = true;
+		else {
+			pr_err("%s%ld: device not created; unknown option: %s\n",
+				iface_to_str(HWE_I2C), index, name);
+			return NULL;
+		}
+	}
+
+	if (!parent != !has_addr || (ten && !parent)) {
+		pr_err("%s%ld: device not created; a client needs an adapter and an address\n",
+			iface_to_str(HWE_I2C), index);
+		return NULL;
+	}
+
+	if (!parent)
+		return new_adapter(hwedev, index);
+
+	if (addr > (ten ? 0x3ff : 0x7f)) {
+		pr_err("%s%ld: device not created; address 0x%x out of range\n",
+			iface_to_str(HWE_I2C), index, addr);
+		return NULL;
+	}
+
+	return new_client(hwedev, index, parent, ten ? addr | I2C_CLIENT_ADDR_TEN : addr);
+}
+
 /*! Destroy an instance of the I2C device.
  */
 void hwe_destroy_i2c_device(struct hwe_dev_priv * device)
 {
+	struct hwe_dev_priv * parent = device->parent;
+	spinlock_t * lock = state_lock(device);
+	struct hwe_dev_priv * c;
+	struct hlist_node * tmp;
+	unsigned bkt;
+
+	/* no new transfers from now on */
+	spin_lock_bh(lock);
 
 	device->in_use = false;
 
+	if (device->is_client) {
+		if (parent) {
+			hash_del(&device->client);
+			parent->client_count--;
+		}
+
+		spin_unlock_bh(lock);
+
+		/* a transfer in progress may have found the client */
+		if (parent)
+			wait_xfers(parent);
+
+		hwe_resp_clear(&device->resp);
+		free_chip(device);
+		kfree(device);
+		return;
+	}
+
+	spin_unlock_bh(lock);
+
+	/* the transfers in progress look at the clients under this lock,
+	 * not their own */
+	wait_xfers(device);
+
+	spin_lock_bh(lock);
+
+	/* the clients stay without an adapter */
+	hash_for_each_safe (device->clients, bkt, tmp, c, client) {
+		hash_del(&c->client);
+		c->parent = NULL;
+	}
+
+	device->client_count = 0;
+
+	spin_unlock_bh(lock);
+
 	i2c_del_adapter(&device->adapter);
+
+	hwe_resp_clear(&device->resp);
+	free_chip(device);
+}
+
+/* Returns 1 if \a dev is the i2c-dev class device of its adapter. */
+static int is_i2c_dev(struct device * dev, void * data)
+{
+	return dev->class && strcmp(dev->class->name, "i2c-dev") == 0;
+}
+
+/*! Write the name of the node of the I2C adapter, or of the parent
+ * of a client, e.g. i2c-0. The node is created by the i2c-dev driver,
+ * so the name is empty unless the driver has attached to the adapter.
+ */
+int hwe_i2c_device_node(struct hwe_dev_priv * device, char * buf, size_t size)
+{
+	if (device->is_client)
+		device = device->parent;
+
+	if (!device ||
+	    !device_for_each_child(&device->adapter.dev, NULL, is_i2c_dev)) {
+		*buf = 0;
+		return 0;
+	}
+
+	return snprintf(buf, size, "i2c-%d", device->adapter.nr);
 }
 
 /*! Initialize the I2C emulator.
@@ -400,24 +1412,49 @@ void hwe_cleanup_i2c(void)
 	pr_info("i2c driver unloaded\n");
 }
 
-void hwe_i2c_async_rx(struct hwe_dev_priv * device, struct hwe_pair * pair)
+static void async_rx(struct hwe_dev_priv * device, struct hwe_pair * pair)
 {
-	if (!device->in_use)
-		return;
+	/* The response is copied into the register image once that part
+	 * of the image is accessed. The same response needn't be copied
+	 * again unless the image has been written since. */
+	device->store_updates++;
+
+	if (pair != device->store_pair) {
+		get_pair(pair);
+
+		if (device->store_pair)
+			put_pair(device->store_pair);
+
+		device->store_pair = pair;
+		device->store_stale = true;
+	}
+	else
+	if (device->store_dirty)
+		device->store_stale = true;
+
+	if (device->store_mapped && !store_still_mapped(device))
+		device->store_mapped = false;
 
-	memcpy(device->chip.dat, pair->resp,
-		pair->resp_size < I2C_CHIP_SIZE ?
-		pair->resp_size : I2C_CHIP_SIZE);
+	if (device->store_mapped)
+		sync_store(device, 0, device->chip.size, false);
 
-	if (device->resp_size && (!device->async || device->resp_ptr != device->resp))
+	if (hwe_resp_pending(&device->resp) &&
+	    (!device->resp.async || device->resp.pos))
 		/* XXX overwrite asynchronous response IFF
 		 * 1) there is no pending response OR
 		 * 2) the pending response is asynchronous AND
 		 * 3) we haven't started reading it yet. */
 		return;
 
-	memcpy(device->resp, pair->resp, pair->resp_size);
-	device->resp_size = pair->resp_size;
-	device->resp_ptr = device->resp;
-	device->async = true;
+	hwe_resp_set(&device->resp, pair, true);
+}
+
+void hwe_i2c_async_rx(struct hwe_dev_priv * device, struct hwe_pair * pair)
+{
+	spin_lock(state_lock(device));
+
+	if (device->in_use)
+		async_rx(device, pair);
+
+	spin_unlock(state_lock(device));
 }
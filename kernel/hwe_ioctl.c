@@ -33,7 +33,7 @@ static inline int parse_devid(unsigned long devid, enum HWE_IFACE * iface, long
 	unsigned ifc = devid >> 24;
 	unsigned idx = devid & ((1 << 24) - 1);
 
-	if (ifc >= HWE_IFACE_COUNT || idx >= HWE_MAX_DEVICES)
+	if (ifc >= HWE_IFACE_COUNT || idx >= HWE_MAX_IFACE_DEVICES(ifc))
 		return 0;
 
 	if (iface)
@@ -52,7 +52,7 @@ static const struct file_operations hwemu_fops = {
 	.unlocked_ioctl = hwemu_ioctl,
 };
 
-extern long hwe_add_device(enum HWE_IFACE iface);
+extern long hwe_add_device(enum HWE_IFACE iface, char * node);
 extern int hwe_delete_device(enum HWE_IFACE iface, long dev_index);
 extern long hwe_add_pair(enum HWE_IFACE iface, long dev_index, const char * pair_str);
 extern int hwe_get_pair_count(enum HWE_IFACE iface, long dev_index);
@@ -67,7 +67,7 @@ static int ioctl_add_device(unsigned long arg)
 	if (arg >= HWE_IFACE_COUNT)
 		return -EINVAL;
 
-	idx = hwe_add_device((enum HWE_IFACE)arg);
+	idx = hwe_add_device((enum HWE_IFACE)arg, NULL);
 
 	if (idx < 0)
 		return idx;
@@ -75,6 +75,31 @@ static int ioctl_add_device(unsigned long arg)
 	return make_devid((enum HWE_IFACE)arg, idx);
 }
 
+static int ioctl_add_device_ex(unsigned long arg)
+{
+	struct hweioctl_device __user * hd = (struct hweioctl_device __user *)arg;
+	char node[HWE_MAX_NODE_NAME + 1] = "";
+	int ifc;
+	long idx;
+
+	if (get_user(ifc, &hd->iface))
+		return -EFAULT;
+
+	if (ifc < 0 || ifc >= HWE_IFACE_COUNT)
+		return -EINVAL;
+
+	idx = hwe_add_device((enum HWE_IFACE)ifc, node);
+
+	if (idx < 0)
+		return idx;
+
+	if (put_user(make_devid((enum HWE_IFACE)ifc, idx), &hd->device_id) ||
+	    copy_to_user(&hd->node, node, sizeof(node)))
+		return -EFAULT;
+
+	return 0;
+}
+
 static int ioctl_delete_device(unsigned long arg)
 {
 	enum HWE_IFACE ifc;
@@ -215,6 +240,9 @@ static long hwemu_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		case HWEIOCTL_ADD_DEVICE:
 			err = ioctl_add_device(arg);
 			break;
+		case HWEIOCTL_ADD_DEVICE_EX:
+			err = ioctl_add_device_ex(arg);
+			break;
 		case HWEIOCTL_UNINSTALL_DEVICE:
 			err = ioctl_delete_device(arg);
 			break;
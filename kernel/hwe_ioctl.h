@@ -77,10 +77,33 @@
 */
 #define HWEIOCTL_CLEAR_PAIRS            (HWEIOCTL_MAGIC + 7)
 
+/*! Add a new emulated device and return the name of its node.
+    arg = pointer to a structure
+        {
+            int iface;
+            int device_id;
+            char node[HWE_MAX_NODE_NAME + 1];
+        }
+    where
+        iface = interface type, as with HWEIOCTL_ADD_DEVICE;
+        device_id = unique device id (filled by the function on return);
+        node = null-terminated name of the device node under /dev, or of
+            the network interface, empty if there is none (filled by the
+            function on return);
+    return: error code.
+*/
+#define HWEIOCTL_ADD_DEVICE_EX          (HWEIOCTL_MAGIC + 8)
+
 struct hweioctl_pair {
 	int device_id;
 	int pair_index;
 	char pair[HWE_MAX_PAIR_STR + 1];
 };
 
+struct hweioctl_device {
+	int iface;
+	int device_id;
+	char node[HWE_MAX_NODE_NAME + 1];
+};
+
 #endif /* HWE_IOCTL_H_INCLUDED */
@@ -14,76 +14,1338 @@
 #include <linux/etherdevice.h>
 #include <linux/ethtool.h>
 #include <linux/skbuff.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/udp.h>
+#include <net/checksum.h>
+#include <net/ip6_checksum.h>
+#include <linux/cpumask.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/inet.h>
+#include <linux/jhash.h>
+#include <linux/ktime.h>
+#include <linux/net_tstamp.h>
+
+/* native XDP relies on the helpers of recent kernels */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0))
+#define HWENET_XDP
+#include <linux/bpf.h>
+#include <linux/bpf_trace.h>
+#include <linux/filter.h>
+#include <net/xdp.h>
+#endif
+
+/* hardware timestamping is configured through its own callbacks */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0))
+#define HWENET_HWTSTAMP_NDO
+#endif
 
 #include "hwemu.h"
 
-#define	NET_DRIVER_NAME	"hwenet"
+#define	NET_DRIVER_NAME	"hwenet"
+
+/*! Size of the receive ring; must be a power of 2 */
+#define HWENET_RING_SIZE	256
+
+/*! Size of the endpoint hash table; must be a power of 2 */
+#define HWENET_ENDPOINT_BUCKETS	256
+
+struct hwe_dev_priv;
+
+/* The statistics counters: the standard ones, then the ones
+ * shown by `ethtool -S` only. */
+#define HWENET_FOREACH_STAT(X) \
+	X(tx_packets) \
+	X(tx_bytes) \
+	X(tx_dropped) \
+	X(rx_packets) \
+	X(rx_bytes) \
+	X(rx_dropped) \
+	/* requests with a response */ \
+	X(matched) \
+	/* requests without a response */ \
+	X(unmatched) \
+	/* unmatched requests rejected by their size alone */ \
+	X(prefilter_rejects) \
+	/* responses sent by the timer */ \
+	X(async) \
+	/* responses lost for lack of memory */ \
+	X(alloc_failures) \
+	/* frames dropped, sent back and redirected by XDP programs */ \
+	X(xdp_drops) \
+	X(xdp_tx) \
+	X(xdp_redirects) \
+	/* frames redirected to the device by XDP programs */ \
+	X(xdp_xmit)
+
+/*! Per-CPU statistics */
+struct hwenet_stats {
+#define X(name) u64 name;
+	HWENET_FOREACH_STAT(X)
+#undef X
+	struct u64_stats_sync syncp;
+};
+
+/* Adds \a n to the counter \a name of the current CPU. All the
+ * counters are updated with BH disabled (in the transmission path,
+ * NAPI or the timer), so this can't be interrupted by another update. */
+#define STATS_ADD(priv, name, n) do { \
+	struct hwenet_stats * __s = this_cpu_ptr((priv)->stats); \
+	u64_stats_update_begin(&__s->syncp); \
+	__s->name += (n); \
+	u64_stats_update_end(&__s->syncp); \
+} while (0)
+
+#define STATS_INC(priv, name) STATS_ADD(priv, name, 1)
+
+/*! An entry of the receive ring: either a response to be copied into
+ * a new skb, a transmitted skb already turned into the response, or,
+ * with an XDP program attached, a response built right into an XDP
+ * buffer (see alloc_xdp_buf()). */
+struct hwenet_rx {
+	struct hwe_pair * pair;
+	struct sk_buff * skb;
+	void * buf;
+	unsigned len;		/* of the frame in buf */
+	/* when the response was injected, if RX timestamping is on */
+	ktime_t tstamp;
+};
+
+/*! A TX/RX queue pair. There is one per CPU: a frame transmitted on
+ * a queue is matched there and its response is delivered by the
+ * queue's own NAPI instance, i.e. on the same CPU.
+ */
+struct hwenet_queue {
+	struct hwe_dev_priv * priv;
+	struct napi_struct napi;
+	/* Responses waiting to be delivered by NAPI. There may be several
+	 * producers (transmission, timer) but only one consumer (NAPI),
+	 * so the lock protects the head only. */
+	spinlock_t rx_lock;
+	struct hwenet_rx rx_ring[HWENET_RING_SIZE];
+	unsigned rx_head;
+	unsigned rx_tail;
+#ifdef HWENET_XDP
+	struct xdp_rxq_info xdp_rxq;
+	/* an XDP program redirected frames during the current poll */
+	bool xdp_flush;
+#endif
+} ____cacheline_aligned_in_smp;
+
+/*! Address of an endpoint: MAC, IPv4 or IPv6, told apart by length */
+struct hwenet_addr {
+	unsigned len;
+	u8 bytes[16];
+};
+
+/*! Private data for the network device
+ *
+ * A device is either a network device or an endpoint emulated by a
+ * network device (its parent): a host with a MAC or an IP address of
+ * its own. An endpoint has its own pairs and settings, and answers
+ * the frames sent to its address through its parent.
+ */
+struct hwe_dev_priv {
+	struct hwe_dev * hwedev;
+	long index;
+	struct list_head devices;
+	bool is_endpoint;
+	/* endpoints only */
+	struct hwe_dev_priv * parent;	/* NULL once the parent is gone */
+	struct hlist_node endpoint;
+	struct hwenet_addr addr;
+	struct rcu_head rcu;
+	/* network devices only */
+	struct net_device *net_dev;
+	struct hlist_head * endpoints;	/* hashed by address */
+	unsigned endpoint_count;
+	struct hwenet_queue * queues;
+	unsigned queue_count;
+	struct hwenet_stats __percpu * stats;
+#ifdef HWENET_XDP
+	struct bpf_prog __rcu * xdp_prog;
+#endif
+	/* hardware timestamping (SIOCSHWTSTAMP) */
+	bool tx_tstamp;
+	bool rx_tstamp;
+	/* settings */
+	bool match_udp;
+	unsigned match_offset;
+};
+
+/*! Location of the UDP payload in a frame */
+struct hwenet_udp {
+	unsigned l3;	/* offset of the IP header */
+	unsigned l4;	/* offset of the UDP header */
+	unsigned size;	/* size of the payload */
+};
+
+static struct list_head devices;
+
+/* With an XDP program attached, responses are built in XDP buffers
+ * rather than in the transmitted skbs. */
+static bool xdp_attached(struct hwe_dev_priv *priv)
+{
+#ifdef HWENET_XDP
+	return !!rcu_access_pointer(priv->xdp_prog);
+#else
+	return false;
+#endif
+}
+
+#ifdef HWENET_XDP
+/* The size of an XDP buffer holding a frame of \a len bytes. The
+ * buffers are page fragments, so that they turn into skbs in place. */
+#define HWENET_XDP_TRUESIZE(len) \
+	(SKB_DATA_ALIGN(XDP_PACKET_HEADROOM + (len)) + \
+	 SKB_DATA_ALIGN(sizeof(struct skb_shared_info)))
+
+/* Whether all the responses of a device with an MTU of \a mtu fit in
+ * an XDP buffer. The largest one is a UDP reply, made of the headers of
+ * a request of up to the MTU and a response; GSO is off while an XDP
+ * program is attached (see hwenet_fix_features()). */
+static bool xdp_mtu_ok(unsigned mtu)
+{
+	return HWENET_XDP_TRUESIZE(ETH_HLEN + mtu + HWE_MAX_RESPONSE) <= PAGE_SIZE;
+}
+
+static struct sk_buff * run_xdp(struct hwenet_queue *q, struct bpf_prog *prog,
+	struct hwenet_rx *rx);
+
+/* Allocates an XDP buffer for a frame of \a len bytes, to be put at
+ * XDP_PACKET_HEADROOM. */
+static void * alloc_xdp_buf(struct hwe_dev_priv *priv, unsigned len)
+{
+	void *buf;
+
+	/* only a response to a GSO packet sent before the program was
+	 * attached can be that large (see xdp_mtu_ok()) */
+	if (HWENET_XDP_TRUESIZE(len) > PAGE_SIZE) {
+		net_warn_ratelimited("%s: a frame of %u bytes is too large "
+			"for XDP; dropped\n", priv->net_dev->name, len);
+		return NULL;
+	}
+
+	buf = netdev_alloc_frag(HWENET_XDP_TRUESIZE(len));
+
+	if (!buf)
+		STATS_INC(priv, alloc_failures);
+
+	return buf;
+}
+
+/* Turns an XDP buffer into an skb holding the \a len bytes at \a off. */
+static struct sk_buff * build_xdp_skb(struct hwenet_queue *q, void *buf,
+	unsigned truesize, unsigned off, unsigned len)
+{
+	struct sk_buff *skb = napi_build_skb(buf, truesize);
+
+	if (!skb) {
+		STATS_INC(q->priv, rx_dropped);
+		STATS_INC(q->priv, alloc_failures);
+		page_frag_free(buf);
+		return NULL;
+	}
+
+	skb_reserve(skb, off);
+	skb_put(skb, len);
+
+	return skb;
+}
+#endif
+
+static struct hlist_head * endpoint_bucket(struct hwe_dev_priv *priv,
+	const void *addr, unsigned len)
+{
+	return &priv->endpoints[jhash(addr, len, len) &
+		(HWENET_ENDPOINT_BUCKETS - 1)];
+}
+
+/* Must be called under rcu_read_lock() or the interface lock. */
+static struct hwe_dev_priv * find_endpoint(struct hwe_dev_priv *priv,
+	const void *addr, unsigned len)
+{
+	struct hwe_dev_priv *ep;
+
+	hlist_for_each_entry_rcu (ep, endpoint_bucket(priv, addr, len), endpoint)
+		if (ep->addr.len == len && memcmp(ep->addr.bytes, addr, len) == 0)
+			return ep;
+
+	return NULL;
+}
+
+/* Returns the endpoint a frame is sent to, by destination MAC address
+ * first, then by destination IP address, or the network device itself.
+ * Must be called under rcu_read_lock(). */
+static struct hwe_dev_priv * route_frame(struct hwe_dev_priv *priv,
+	const unsigned char *frame, unsigned len)
+{
+	const struct ethhdr *eth = (const void *)frame;
+	struct hwe_dev_priv *ep = NULL;
+
+	if (!READ_ONCE(priv->endpoint_count) || len < ETH_HLEN)
+		return priv;
+
+	ep = find_endpoint(priv, eth->h_dest, ETH_ALEN);
+
+	if (ep)
+		return ep;
+
+	if (eth->h_proto == htons(ETH_P_IP) &&
+	    len >= ETH_HLEN + sizeof(struct iphdr)) {
+		const struct iphdr *iph = (const void *)(frame + ETH_HLEN);
+
+		ep = find_endpoint(priv, &iph->daddr, sizeof(iph->daddr));
+	}
+	else
+	if (eth->h_proto == htons(ETH_P_IPV6) &&
+	    len >= ETH_HLEN + sizeof(struct ipv6hdr)) {
+		const struct ipv6hdr *ip6h = (const void *)(frame + ETH_HLEN);
+
+		ep = find_endpoint(priv, &ip6h->daddr, sizeof(ip6h->daddr));
+	}
+
+	return ep ? ep : priv;
+}
+
+static void free_rx(struct hwenet_rx *rx)
+{
+	if (rx->skb)
+		dev_kfree_skb_any(rx->skb);
+	else
+	if (rx->buf)
+		skb_free_frag(rx->buf);
+	else
+		put_pair(rx->pair);
+}
+
+/* Queues the response \a e for delivery by NAPI. Takes over the
+ * caller's reference to the pair, the skb or the buffer. */
+static void queue_rx_entry(struct hwenet_queue *q, struct hwenet_rx *e)
+{
+	struct hwenet_rx *rx = NULL;
+
+	/* the emulated hardware receives the response right now */
+	e->tstamp = READ_ONCE(q->priv->rx_tstamp) ? ktime_get_real() : 0;
+
+	spin_lock(&q->rx_lock);
+
+	if (q->rx_head - q->rx_tail < HWENET_RING_SIZE) {
+		rx = &q->rx_ring[q->rx_head++ & (HWENET_RING_SIZE - 1)];
+		*rx = *e;
+	}
+
+	spin_unlock(&q->rx_lock);
+
+	if (rx)
+		napi_schedule(&q->napi);
+	else {
+		free_rx(e);
+		STATS_INC(q->priv, rx_dropped);
+	}
+}
+
+static void queue_rx(struct hwenet_queue *q, struct hwe_pair *pair,
+	struct sk_buff *skb)
+{
+	struct hwenet_rx e = { .pair = pair, .skb = skb };
+
+	queue_rx_entry(q, &e);
+}
+
+static void purge_rx_ring(struct hwenet_queue *q)
+{
+	spin_lock_bh(&q->rx_lock);
+
+	while (q->rx_tail != q->rx_head)
+		free_rx(&q->rx_ring[q->rx_tail++ & (HWENET_RING_SIZE - 1)]);
+
+	spin_unlock_bh(&q->rx_lock);
+}
+
+/* Prepares the transmitted \a skb to carry a response of \a len bytes
+ * back, if the skb is ours alone and has room for the response. The
+ * caller fills in the data. Returns false if the skb can't be reused. */
+static bool recycle_skb(struct sk_buff *skb, unsigned len)
+{
+	if (skb_shared(skb) || skb_cloned(skb) || skb_is_nonlinear(skb))
+		return false;
+
+	if (len > skb->len + skb_tailroom(skb))
+		return false;
+
+	if (len > skb->len)
+		skb_put(skb, len - skb->len);
+	else
+		skb_trim(skb, len);
+
+	/* it now belongs to the receive path rather than to the sender,
+	 * and carries a single frame, even if it was a GSO packet */
+	skb_orphan(skb);
+	skb_scrub_packet(skb, true);
+	skb_shinfo(skb)->tx_flags = 0;
+	skb_gso_reset(skb);
+
+	return true;
+}
+
+static void receive(struct hwenet_queue *q, struct hwenet_rx *rx)
+{
+	struct net_device *ndev = q->priv->net_dev;
+	struct sk_buff *skb = rx->skb;
+#ifdef HWENET_XDP
+	struct bpf_prog *prog;
+#endif
+
+	STATS_INC(q->priv, rx_packets);
+	STATS_ADD(q->priv, rx_bytes, skb ? skb->len :
+		rx->buf ? rx->len : rx->pair->resp_size);
+
+#ifdef HWENET_XDP
+	rcu_read_lock();
+
+	prog = rcu_dereference(q->priv->xdp_prog);
+
+	if (prog)
+		skb = run_xdp(q, prog, rx);
+
+	rcu_read_unlock();
+
+	/* unless passed, the frame has been taken care of */
+	if (prog && !skb)
+		return;
+
+	/* the program was detached after the response was built */
+	if (!prog && rx->buf) {
+		skb = build_xdp_skb(q, rx->buf, HWENET_XDP_TRUESIZE(rx->len),
+			XDP_PACKET_HEADROOM, rx->len);
+
+		if (!skb)
+			return;
+	}
+#endif
+
+	if (!skb) {
+		const struct hwe_pair *pair = rx->pair;
+
+		skb = napi_alloc_skb(&q->napi, pair->resp_size);
+
+		if (!skb) {
+			STATS_INC(q->priv, rx_dropped);
+			STATS_INC(q->priv, alloc_failures);
+			return;
+		}
+
+		memcpy(skb_put(skb, pair->resp_size), pair->resp, pair->resp_size);
+	}
+
+	if (rx->tstamp)
+		skb_hwtstamps(skb)->hwtstamp = rx->tstamp;
+
+	skb->protocol = eth_type_trans(skb, ndev);
+	skb->ip_summed = CHECKSUM_UNNECESSARY;
+	skb_record_rx_queue(skb, q - q->priv->queues);
+
+	/* GRO hands the frames over to the stack in batches */
+	napi_gro_receive(&q->napi, skb);
+}
+
+static int hwenet_poll(struct napi_struct *napi, int budget)
+{
+	struct hwenet_queue *q = container_of(napi, struct hwenet_queue, napi);
+	unsigned n;
+	unsigned i;
+
+	spin_lock(&q->rx_lock);
+	n = min_t(unsigned, budget, q->rx_head - q->rx_tail);
+	spin_unlock(&q->rx_lock);
+
+	/* the producers don't touch the entries until we move the tail */
+	for (i = 0; i < n; i++) {
+		struct hwenet_rx *rx =
+			&q->rx_ring[(q->rx_tail + i) & (HWENET_RING_SIZE - 1)];
+
+		/* the skb or the buffer, if any, is passed on to the stack */
+		receive(q, rx);
+
+		if (rx->pair)
+			put_pair(rx->pair);
+	}
+
+	spin_lock(&q->rx_lock);
+	q->rx_tail += n;
+	spin_unlock(&q->rx_lock);
+
+#ifdef HWENET_XDP
+	if (q->xdp_flush) {
+		xdp_do_flush();
+		q->xdp_flush = false;
+	}
+#endif
+
+	if (n < budget)
+		napi_complete_done(napi, n);
+
+	return n;
+}
+
+static int hwenet_open(struct net_device *ndev)
+{
+	struct hwe_dev_priv *priv = netdev_priv(ndev);
+	unsigned i;
+
+	for (i = 0; i < priv->queue_count; i++)
+		napi_enable(&priv->queues[i].napi);
+
+	netif_tx_start_all_queues(ndev);
+	return 0;
+}
+
+static int hwenet_stop(struct net_device *ndev)
+{
+	struct hwe_dev_priv *priv = netdev_priv(ndev);
+	unsigned i;
+
+	netif_tx_stop_all_queues(ndev);
+
+	for (i = 0; i < priv->queue_count; i++) {
+		napi_disable(&priv->queues[i].napi);
+		purge_rx_ring(&priv->queues[i]);
+	}
+
+	return 0;
+}
+
+/*! A request, possibly in the non-linear data of an skb */
+struct hwenet_req {
+	const unsigned char *data;
+	unsigned head;		/* size of the part at data */
+	unsigned size;
+	/* where the whole request is, if head < size */
+	struct sk_buff *skb;
+	unsigned offset;
+};
+
+/* Compares the request with the skb data, fragment by fragment. */
+static bool skb_equal(const unsigned char *req, size_t size, void *arg)
+{
+	struct hwenet_req *r = arg;
+	struct skb_seq_state st;
+	const u8 *data;
+	unsigned pos = 0;
+	unsigned n;
+
+	skb_prepare_seq_read(r->skb, r->offset, r->offset + size, &st);
+
+	while (pos < size && (n = skb_seq_read(pos, &data, &st)) != 0) {
+		n = min_t(unsigned, n, size - pos);
+
+		if (memcmp(data, req + pos, n))
+			break;
+
+		pos += n;
+	}
+
+	skb_abort_seq_read(&st);
+
+	return pos == size;
+}
+
+/* Returns the pair of \a ep (the network device \a priv or one of its
+ * endpoints) matching \a r with a reference taken, or NULL. */
+static struct hwe_pair * lookup_req(struct hwe_dev_priv *priv,
+	struct hwe_dev_priv *ep, struct hwenet_req *r)
+{
+	struct hwe_pair * pair = NULL;
+
+	if (!may_find_response(ep->hwedev, r->size))
+		STATS_INC(priv, prefilter_rejects);
+	else {
+		/* The TX queues run in parallel, so the pair list is
+		 * searched without the device lock. */
+		rcu_read_lock();
+
+		if (r->head == r->size)
+			pair = find_response(ep->hwedev, r->data, r->size);
+		else
+			pair = find_pair_cb(get_pair_list(ep->hwedev), r->size,
+				skb_equal, r);
+
+		if (pair && !try_get_pair(pair))
+			pair = NULL;
+
+		rcu_read_unlock();
+	}
+
+	if (pair)
+		STATS_INC(priv, matched);
+	else
+		STATS_INC(priv, unmatched);
+
+	/* only the linear part of a fragmented request is logged */
+	hwe_log_request(HWE_NET, ep->index, r->data, r->head, !!pair);
+
+	if (pair)
+		hwe_log_response(HWE_NET, ep->index, pair->resp, pair->resp_size);
+
+	return pair;
+}
+
+/* Returns the pair matching the \a size bytes of \a skb at \a offset
+ * with a reference taken, or NULL. */
+static struct hwe_pair * lookup(struct hwe_dev_priv *priv,
+	struct hwe_dev_priv *ep, struct sk_buff *skb, unsigned offset,
+	unsigned size)
+{
+	struct hwenet_req r = {
+		.data = skb->data + offset,
+		/* the part of the request in the linear data */
+		.head = offset < skb_headlen(skb) ?
+			min(size, skb_headlen(skb) - offset) : 0,
+		.size = size,
+		.skb = skb,
+		.offset = offset,
+	};
+
+	return lookup_req(priv, ep, &r);
+}
+
+/* Finds the payload of a UDP datagram in an Ethernet frame. */
+static bool parse_udp(const struct sk_buff *skb, struct hwenet_udp *u)
+{
+	const unsigned char *frame = skb->data;
+	/* the headers must be in the linear data */
+	unsigned len = skb_headlen(skb);
+	const struct ethhdr *eth = (const void *)frame;
+	const struct udphdr *udph;
+	unsigned ulen;
+
+	if (len < ETH_HLEN)
+		return false;
+
+	u->l3 = ETH_HLEN;
+
+	if (eth->h_proto == htons(ETH_P_IP)) {
+		const struct iphdr *iph = (const void *)(frame + u->l3);
+
+		if (len < u->l3 + sizeof(*iph) || iph->version != 4 ||
+		    iph->ihl < 5 || iph->protocol != IPPROTO_UDP ||
+		    ip_is_fragment(iph))
+			return false;
+
+		u->l4 = u->l3 + iph->ihl * 4;
+	}
+	else
+	if (eth->h_proto == htons(ETH_P_IPV6)) {
+		const struct ipv6hdr *ip6h = (const void *)(frame + u->l3);
+
+		/* no extension headers */
+		if (len < u->l3 + sizeof(*ip6h) || ip6h->nexthdr != IPPROTO_UDP)
+			return false;
+
+		u->l4 = u->l3 + sizeof(*ip6h);
+	}
+	else
+		return false;
+
+	if (len < u->l4 + sizeof(*udph))
+		return false;
+
+	udph = (const void *)(frame + u->l4);
+	ulen = ntohs(udph->len);
+
+	if (ulen < sizeof(*udph) || u->l4 + ulen > skb->len)
+		return false;
+
+	u->size = ulen - sizeof(*udph);
+
+	return true;
+}
+
+/* Turns the headers of a UDP datagram into those of the reply to it,
+ * which has \a size bytes of payload: the addresses and the ports are
+ * swapped, and the lengths and the checksums are recomputed. */
+static void make_udp_reply(unsigned char *frame, const struct hwenet_udp *u,
+	unsigned size)
+{
+	struct ethhdr *eth = (void *)frame;
+	struct udphdr *udph = (void *)(frame + u->l4);
+	unsigned ulen = sizeof(*udph) + size;
+	unsigned char mac[ETH_ALEN];
+	__be16 port;
+
+	ether_addr_copy(mac, eth->h_dest);
+	ether_addr_copy(eth->h_dest, eth->h_source);
+	ether_addr_copy(eth->h_source, mac);
+
+	port = udph->source;
+	udph->source = udph->dest;
+	udph->dest = port;
+	udph->len = htons(ulen);
+	udph->check = 0;
+
+	if (eth->h_proto == htons(ETH_P_IP)) {
+		struct iphdr *iph = (void *)(frame + u->l3);
+		__be32 addr = iph->saddr;
+
+		iph->saddr = iph->daddr;
+		iph->daddr = addr;
+		iph->tot_len = htons(u->l4 - u->l3 + ulen);
+		ip_send_check(iph);
+
+		udph->check = csum_tcpudp_magic(iph->saddr, iph->daddr, ulen,
+			IPPROTO_UDP, csum_partial(udph, ulen, 0));
+	}
+	else {
+		struct ipv6hdr *ip6h = (void *)(frame + u->l3);
+		struct in6_addr addr = ip6h->saddr;
+
+		ip6h->saddr = ip6h->daddr;
+		ip6h->daddr = addr;
+		ip6h->payload_len = htons(ulen);
+
+		udph->check = csum_ipv6_magic(&ip6h->saddr, &ip6h->daddr, ulen,
+			IPPROTO_UDP, csum_partial(udph, ulen, 0));
+	}
+
+	if (!udph->check)
+		udph->check = CSUM_MANGLED_0;
+}
+
+/* Matches the payload of a UDP datagram, past the first match_offset
+ * bytes, and answers it with a datagram going the other way. The
+ * skipped bytes (e.g. a transaction ID) are copied into the reply. */
+static void xmit_udp(struct hwenet_queue *q, struct hwe_dev_priv *ep,
+	struct sk_buff *skb)
+{
+	struct hwe_dev_priv *priv = q->priv;
+	unsigned offset = READ_ONCE(ep->match_offset);
+	struct hwenet_udp u;
+	struct hwe_pair * pair;
+	struct sk_buff *resp;
+	unsigned hdr;
+	unsigned len;
+
+	if (!parse_udp(skb, &u) || u.size <= offset) {
+		STATS_INC(priv, unmatched);
+		hwe_log_request(HWE_NET, ep->index, skb->data, skb_headlen(skb), false);
+		dev_kfree_skb(skb);
+		return;
+	}
+
+	/* the headers and the part of the payload we don't match */
+	hdr = u.l4 + sizeof(struct udphdr) + offset;
+
+	pair = lookup(priv, ep, skb, hdr, u.size - offset);
+
+	if (!pair) {
+		dev_kfree_skb(skb);
+		return;
+	}
+
+	len = hdr + pair->resp_size;
+
+#ifdef HWENET_XDP
+	if (xdp_attached(priv)) {
+		/* no skb is built for the reply */
+		struct hwenet_rx e = { .len = len };
+
+		e.buf = alloc_xdp_buf(priv, len);
+
+		if (e.buf) {
+			unsigned char *frame = e.buf + XDP_PACKET_HEADROOM;
+
+			/* the skipped part of the payload may be in the
+			 * fragments */
+			skb_copy_bits(skb, 0, frame, hdr);
+			memcpy(frame + hdr, pair->resp, pair->resp_size);
+			make_udp_reply(frame, &u, offset + pair->resp_size);
+			queue_rx_entry(q, &e);
+		}
+		else
+			STATS_INC(priv, rx_dropped);
+
+		dev_kfree_skb(skb);
+		put_pair(pair);
+		return;
+	}
+#endif
+
+	if (!xdp_attached(priv) && recycle_skb(skb, len))
+		resp = skb;
+	else {
+		resp = netdev_alloc_skb_ip_align(priv->net_dev, len);
+
+		/* the skipped part of the payload may be in the fragments */
+		if (resp)
+			skb_copy_bits(skb, 0, skb_put(resp, len), hdr);
+
+		dev_kfree_skb(skb);
+	}
+
+	if (resp) {
+		memcpy(resp->data + hdr, pair->resp, pair->resp_size);
+		make_udp_reply(resp->data, &u, offset + pair->resp_size);
+		queue_rx(q, NULL, resp);
+	}
+	else {
+		STATS_INC(priv, rx_dropped);
+		STATS_INC(priv, alloc_failures);
+	}
+
+	put_pair(pair);
+}
+
+#ifdef HWENET_XDP
+/* Answers a frame sent by an XDP program, either redirected to the
+ * device or bounced back with XDP_TX. */
+static void xmit_xdp_frame(struct hwenet_queue *q, struct xdp_frame *frame)
+{
+	struct hwe_dev_priv *priv = q->priv;
+	struct hwenet_req r = { frame->data, frame->len, frame->len, NULL, 0 };
+	struct hwe_dev_priv *ep;
+	struct hwe_pair * pair;
+
+	STATS_INC(priv, tx_packets);
+	STATS_ADD(priv, tx_bytes, frame->len);
+
+	rcu_read_lock();
+
+	ep = route_frame(priv, frame->data, frame->len);
+
+	if (READ_ONCE(ep->match_udp)) {
+		/* the reply is made of the request's headers */
+		struct sk_buff *skb = xdp_build_skb_from_frame(frame, priv->net_dev);
+
+		if (!skb) {
+			STATS_INC(priv, tx_dropped);
+			STATS_INC(priv, alloc_failures);
+			xdp_return_frame(frame);
+		}
+		else {
+			/* undo eth_type_trans() */
+			skb_push(skb, ETH_HLEN);
+			xmit_udp(q, ep, skb);
+		}
+
+		rcu_read_unlock();
+		return;
+	}
+
+	pair = lookup_req(priv, ep, &r);
+
+	rcu_read_unlock();
+
+	xdp_return_frame(frame);
+
+	if (pair)
+		queue_rx(q, pair, NULL);
+}
+
+/* Runs the XDP program on a response before any skb is built.
+ * Returns the skb to pass to the stack, or NULL if the program
+ * did something else with the frame. */
+static struct sk_buff * run_xdp(struct hwenet_queue *q, struct bpf_prog *prog,
+	struct hwenet_rx *rx)
+{
+	struct hwe_dev_priv *priv = q->priv;
+	struct net_device *ndev = priv->net_dev;
+	unsigned len = rx->skb ? rx->skb->len :
+		rx->buf ? rx->len : rx->pair->resp_size;
+	unsigned truesize = HWENET_XDP_TRUESIZE(len);
+	struct xdp_frame *frame;
+	struct xdp_buff xdp;
+	void *buf = rx->buf;
+	u32 act;
+
+	/* a response queued before the program was attached */
+	if (!buf) {
+		buf = alloc_xdp_buf(priv, len);
+
+		if (buf)
+			memcpy(buf + XDP_PACKET_HEADROOM,
+				rx->skb ? rx->skb->data : rx->pair->resp, len);
+
+		/* the response is in the buffer now */
+		if (rx->skb)
+			consume_skb(rx->skb);
+
+		if (!buf) {
+			STATS_INC(priv, rx_dropped);
+			return NULL;
+		}
+	}
+
+	xdp_init_buff(&xdp, truesize, &q->xdp_rxq);
+	xdp_prepare_buff(&xdp, buf, XDP_PACKET_HEADROOM, len, false);
+
+	act = bpf_prog_run_xdp(prog, &xdp);
+
+	switch (act) {
+	case XDP_PASS:
+		return build_xdp_skb(q, buf, truesize, xdp.data - buf,
+			xdp.data_end - xdp.data);
+	case XDP_TX:
+		frame = xdp_convert_buff_to_frame(&xdp);
+
+		if (!frame)
+			break;
+
+		STATS_INC(priv, xdp_tx);
+		/* the frame goes back to the emulator */
+		xmit_xdp_frame(q, frame);
+		return NULL;
+	case XDP_REDIRECT:
+		if (xdp_do_redirect(ndev, &xdp, prog))
+			break;
+
+		STATS_INC(priv, xdp_redirects);
+		q->xdp_flush = true;
+		return NULL;
+	default:
+		bpf_warn_invalid_xdp_action(ndev, prog, act);
+		fallthrough;
+	case XDP_ABORTED:
+		trace_xdp_exception(ndev, prog, act);
+		fallthrough;
+	case XDP_DROP:
+		break;
+	}
 
-/*! Private data for the network device */
-struct hwe_dev_priv {
-	struct hwe_dev * hwedev;
-	long index;
-	struct net_device *net_dev;
-	struct list_head devices;
-};
+	STATS_INC(priv, xdp_drops);
+	page_frag_free(buf);
+	return NULL;
+}
 
-static struct list_head devices;
+static int hwenet_xdp_xmit(struct net_device *ndev, int n,
+	struct xdp_frame **frames, u32 flags)
+{
+	struct hwe_dev_priv *priv = netdev_priv(ndev);
+	struct hwenet_queue *q;
+	int i;
 
-static int hwenet_open(struct net_device *ndev)
+	if (flags & ~XDP_XMIT_FLAGS_MASK)
+		return -EINVAL;
+
+	if (!netif_running(ndev))
+		return -ENETDOWN;
+
+	/* answered on the sender's CPU, like the frames from the stack */
+	q = &priv->queues[smp_processor_id() % priv->queue_count];
+
+	for (i = 0; i < n; i++)
+		xmit_xdp_frame(q, frames[i]);
+
+	STATS_ADD(priv, xdp_xmit, n);
+
+	return n;
+}
+
+static int hwenet_bpf(struct net_device *ndev, struct netdev_bpf *bpf)
 {
-	netif_start_queue(ndev);
-	return 0;
+	struct hwe_dev_priv *priv = netdev_priv(ndev);
+	struct bpf_prog *old;
+
+	switch (bpf->command) {
+	case XDP_SETUP_PROG:
+		/* a response which didn't fit would be dropped */
+		if (bpf->prog && !xdp_mtu_ok(ndev->mtu)) {
+			NL_SET_ERR_MSG_MOD(bpf->extack,
+				"MTU too large for XDP with the largest responses");
+			return -EOPNOTSUPP;
+		}
+
+		/* we own the reference to the new program */
+		old = rcu_replace_pointer(priv->xdp_prog, bpf->prog,
+			lockdep_rtnl_is_held());
+
+		if (old)
+			bpf_prog_put(old);
+
+		/* GSO goes off or on again */
+		if (!old != !bpf->prog)
+			netdev_update_features(ndev);
+
+		return 0;
+	default:
+		return -EINVAL;
+	}
 }
 
-static int hwenet_stop(struct net_device *ndev)
+/* GSO packets would make UDP replies larger than an XDP buffer */
+static netdev_features_t hwenet_fix_features(struct net_device *ndev,
+	netdev_features_t features)
+{
+	if (xdp_attached(netdev_priv(ndev)))
+		features &= ~NETIF_F_GSO_SOFTWARE;
+
+	return features;
+}
+
+/* While an XDP program is attached, the MTU is limited like in real
+ * drivers. */
+static int hwenet_change_mtu(struct net_device *ndev, int mtu)
 {
-	netif_stop_queue(ndev);
+	if (xdp_attached(netdev_priv(ndev)) && !xdp_mtu_ok(mtu)) {
+		netdev_warn(ndev, "MTU %d too large for XDP\n", mtu);
+		return -EINVAL;
+	}
+
+	WRITE_ONCE(ndev->mtu, mtu);
+
 	return 0;
 }
+#endif
 
-static int send_response(struct net_device *dev, const char * data, unsigned int len)
+static void xmit_frame(struct hwenet_queue *q, struct sk_buff *skb)
 {
-	struct sk_buff *skb = dev_alloc_skb(len + 2);
+	struct hwe_dev_priv *priv = q->priv;
+	struct hwe_dev_priv *ep;
+	struct hwe_pair * pair;
 
-	skb_reserve(skb, 2);
-	memcpy(skb_put(skb, len), data, len);
-	skb->dev = dev;
-	skb->protocol = eth_type_trans(skb, dev);
-	skb->ip_summed = CHECKSUM_UNNECESSARY;
-	dev->stats.rx_packets++;
-	return netif_rx(skb);
+	STATS_INC(priv, tx_packets);
+	STATS_ADD(priv, tx_bytes, skb->len);
+
+	/* endpoints go away after a grace period */
+	rcu_read_lock();
+
+	ep = route_frame(priv, skb->data, skb_headlen(skb));
+
+	if (READ_ONCE(ep->match_udp)) {
+		xmit_udp(q, ep, skb);
+		rcu_read_unlock();
+		return;
+	}
+
+	pair = lookup(priv, ep, skb, 0, skb->len);
+
+	rcu_read_unlock();
+
+	if (!pair) {
+		dev_kfree_skb(skb);
+		return;
+	}
+
+	/* the turnaround path: the response reuses the request's skb;
+	 * an echo response is already there */
+	if (!xdp_attached(priv) && recycle_skb(skb, pair->resp_size)) {
+		if (!pair->echo)
+			memcpy(skb->data, pair->resp, pair->resp_size);
+
+		put_pair(pair);
+		queue_rx(q, NULL, skb);
+	}
+	else {
+		dev_kfree_skb(skb);
+		queue_rx(q, pair, NULL);
+	}
 }
 
 static int hwenet_xmit(struct sk_buff *skb, struct net_device *ndev)
 {
 	struct hwe_dev_priv *priv = netdev_priv(ndev);
-	struct hwe_pair * pair;
+	struct hwenet_queue *q = &priv->queues[skb_get_queue_mapping(skb)];
+
+	/* the emulated hardware sends the request right now */
+	if (unlikely(skb_shinfo(skb)->tx_flags & SKBTX_HW_TSTAMP) &&
+	    READ_ONCE(priv->tx_tstamp)) {
+		struct skb_shared_hwtstamps hwts = { .hwtstamp = ktime_get_real() };
+
+		skb_shinfo(skb)->tx_flags |= SKBTX_IN_PROGRESS;
+		skb_tstamp_tx(skb, &hwts);
+	}
 
-	ndev->stats.tx_bytes += skb->len;
-	ndev->stats.tx_packets++;
 	skb_tx_timestamp(skb);
 
-	pair = find_response(priv->hwedev, skb->data, skb->len);
-	hwe_log_request(HWE_NET, priv->index, skb->data, skb->len, !!pair);
+	xmit_frame(q, skb);
+
+	return NETDEV_TX_OK;
+}
+
+/* Sums up the counters of all the CPUs. */
+static void get_stats(struct hwe_dev_priv *priv, struct hwenet_stats *sum)
+{
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for_each_possible_cpu(cpu) {
+		const struct hwenet_stats *s = per_cpu_ptr(priv->stats, cpu);
+		struct hwenet_stats tmp;
+		unsigned start;
 
-	dev_kfree_skb(skb);
+		do {
+			start = u64_stats_fetch_begin(&s->syncp);
+#define X(name) tmp.name = s->name;
+			HWENET_FOREACH_STAT(X)
+#undef X
+		} while (u64_stats_fetch_retry(&s->syncp, start));
 
-	if (pair) {
-		hwe_log_response(HWE_NET, priv->index, pair->resp, pair->resp_size);
-		return send_response(ndev, pair->resp, pair->resp_size);
+#define X(name) sum->name += tmp.name;
+		HWENET_FOREACH_STAT(X)
+#undef X
 	}
+}
 
-	return NETDEV_TX_OK;
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0))
+static struct rtnl_link_stats64 * hwenet_get_stats64(struct net_device *ndev,
+	struct rtnl_link_stats64 *stats)
+#else
+static void hwenet_get_stats64(struct net_device *ndev,
+	struct rtnl_link_stats64 *stats)
+#endif
+{
+	struct hwenet_stats sum;
+
+	get_stats(netdev_priv(ndev), &sum);
+
+	stats->tx_packets = sum.tx_packets;
+	stats->tx_bytes = sum.tx_bytes;
+	stats->tx_dropped = sum.tx_dropped;
+	stats->rx_packets = sum.rx_packets;
+	stats->rx_bytes = sum.rx_bytes;
+	stats->rx_dropped = sum.rx_dropped;
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0))
+	return stats;
+#endif
+}
+
+static const char hwenet_stat_names[][ETH_GSTRING_LEN] = {
+#define X(name) #name,
+	HWENET_FOREACH_STAT(X)
+#undef X
+};
+
+static int hwenet_get_sset_count(struct net_device *ndev, int sset)
+{
+	return sset == ETH_SS_STATS ? COUNTOF(hwenet_stat_names) : -EOPNOTSUPP;
+}
+
+static void hwenet_get_strings(struct net_device *ndev, u32 sset, u8 *data)
+{
+	if (sset == ETH_SS_STATS)
+		memcpy(data, hwenet_stat_names, sizeof(hwenet_stat_names));
+}
+
+static void hwenet_get_ethtool_stats(struct net_device *ndev,
+	struct ethtool_stats *estats, u64 *data)
+{
+	struct hwenet_stats sum;
+
+	get_stats(netdev_priv(ndev), &sum);
+
+#define X(name) *data++ = sum.name;
+	HWENET_FOREACH_STAT(X)
+#undef X
+}
+
+/* The timestamps come from the realtime clock, there is no PHC. */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0))
+static int hwenet_get_ts_info(struct net_device *ndev,
+	struct ethtool_ts_info *info)
+#else
+static int hwenet_get_ts_info(struct net_device *ndev,
+	struct kernel_ethtool_ts_info *info)
+#endif
+{
+	info->so_timestamping = SOF_TIMESTAMPING_TX_HARDWARE |
+		SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+		SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE |
+		SOF_TIMESTAMPING_SOFTWARE;
+	info->phc_index = -1;
+	info->tx_types = BIT(HWTSTAMP_TX_OFF) | BIT(HWTSTAMP_TX_ON);
+	info->rx_filters = BIT(HWTSTAMP_FILTER_NONE) | BIT(HWTSTAMP_FILTER_ALL);
+
+	return 0;
+}
+
+static const struct ethtool_ops hwe_ethtool_ops = {
+	.get_link = ethtool_op_get_link,
+	.get_sset_count = hwenet_get_sset_count,
+	.get_strings = hwenet_get_strings,
+	.get_ethtool_stats = hwenet_get_ethtool_stats,
+	.get_ts_info = hwenet_get_ts_info,
+};
+
+/* Applies a timestamping configuration. Every received frame is
+ * timestamped if any is to be, as \a rx_filter tells the caller. */
+static int set_tstamp(struct hwe_dev_priv *priv, int tx_type, int *rx_filter)
+{
+	if (tx_type != HWTSTAMP_TX_OFF && tx_type != HWTSTAMP_TX_ON)
+		return -ERANGE;
+
+	/* every packet is timestamped, so any filter is upgraded to all */
+	switch (*rx_filter) {
+	case HWTSTAMP_FILTER_NONE:
+		break;
+	case HWTSTAMP_FILTER_ALL:
+	case HWTSTAMP_FILTER_SOME:
+	case HWTSTAMP_FILTER_PTP_V1_L4_EVENT:
+	case HWTSTAMP_FILTER_PTP_V1_L4_SYNC:
+	case HWTSTAMP_FILTER_PTP_V1_L4_DELAY_REQ:
+	case HWTSTAMP_FILTER_PTP_V2_L4_EVENT:
+	case HWTSTAMP_FILTER_PTP_V2_L4_SYNC:
+	case HWTSTAMP_FILTER_PTP_V2_L4_DELAY_REQ:
+	case HWTSTAMP_FILTER_PTP_V2_L2_EVENT:
+	case HWTSTAMP_FILTER_PTP_V2_L2_SYNC:
+	case HWTSTAMP_FILTER_PTP_V2_L2_DELAY_REQ:
+	case HWTSTAMP_FILTER_PTP_V2_EVENT:
+	case HWTSTAMP_FILTER_PTP_V2_SYNC:
+	case HWTSTAMP_FILTER_PTP_V2_DELAY_REQ:
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0))
+	case HWTSTAMP_FILTER_NTP_ALL:
+#endif
+		*rx_filter = HWTSTAMP_FILTER_ALL;
+		break;
+	default:
+		return -ERANGE;
+	}
+
+	WRITE_ONCE(priv->tx_tstamp, tx_type == HWTSTAMP_TX_ON);
+	WRITE_ONCE(priv->rx_tstamp, *rx_filter == HWTSTAMP_FILTER_ALL);
+
+	return 0;
+}
+
+#ifdef HWENET_HWTSTAMP_NDO
+
+static int hwenet_hwtstamp_get(struct net_device *ndev,
+	struct kernel_hwtstamp_config *cfg)
+{
+	struct hwe_dev_priv *priv = netdev_priv(ndev);
+
+	cfg->flags = 0;
+	cfg->tx_type = priv->tx_tstamp ? HWTSTAMP_TX_ON : HWTSTAMP_TX_OFF;
+	cfg->rx_filter = priv->rx_tstamp ? HWTSTAMP_FILTER_ALL :
+		HWTSTAMP_FILTER_NONE;
+
+	return 0;
+}
+
+static int hwenet_hwtstamp_set(struct net_device *ndev,
+	struct kernel_hwtstamp_config *cfg, struct netlink_ext_ack *extack)
+{
+	return set_tstamp(netdev_priv(ndev), cfg->tx_type, &cfg->rx_filter);
+}
+
+#else
+
+static int hwenet_ioctl(struct net_device *ndev, struct ifreq *ifr, int cmd)
+{
+	struct hwe_dev_priv *priv = netdev_priv(ndev);
+	struct hwtstamp_config cfg;
+	int err;
+
+	switch (cmd) {
+	case SIOCSHWTSTAMP:
+		if (copy_from_user(&cfg, ifr->ifr_data, sizeof(cfg)))
+			return -EFAULT;
+
+		if (cfg.flags)
+			return -EINVAL;
+
+		err = set_tstamp(priv, cfg.tx_type, &cfg.rx_filter);
+
+		if (err)
+			return err;
+
+		break;
+	case SIOCGHWTSTAMP:
+		cfg.flags = 0;
+		cfg.tx_type = priv->tx_tstamp ? HWTSTAMP_TX_ON : HWTSTAMP_TX_OFF;
+		cfg.rx_filter = priv->rx_tstamp ? HWTSTAMP_FILTER_ALL :
+			HWTSTAMP_FILTER_NONE;
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	return copy_to_user(ifr->ifr_data, &cfg, sizeof(cfg)) ? -EFAULT : 0;
 }
 
+#endif
+
 static const struct net_device_ops hwe_netdev_ops = {
 	.ndo_open = hwenet_open,
 	.ndo_stop = hwenet_stop,
 	.ndo_start_xmit = hwenet_xmit,
+	.ndo_get_stats64 = hwenet_get_stats64,
+#ifdef HWENET_XDP
+	.ndo_bpf = hwenet_bpf,
+	.ndo_xdp_xmit = hwenet_xdp_xmit,
+	.ndo_fix_features = hwenet_fix_features,
+	.ndo_change_mtu = hwenet_change_mtu,
+#endif
+#if defined(HWENET_HWTSTAMP_NDO)
+	.ndo_hwtstamp_get = hwenet_hwtstamp_get,
+	.ndo_hwtstamp_set = hwenet_hwtstamp_set,
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0))
+	.ndo_eth_ioctl = hwenet_ioctl,
+#else
+	.ndo_do_ioctl = hwenet_ioctl,
+#endif
 	.ndo_validate_addr = eth_validate_addr,
 	.ndo_set_mac_address = eth_mac_addr,
 };
 
+static ssize_t match_show(struct hwe_dev * hwedev,
+	struct dev_attribute * attr, char * buf)
+{
+	ssize_t ret;
+
+	lock_devs(hwedev);
+
+	ret = sprintf(buf, "%s", hwe_get_dev_priv(hwedev)->match_udp ?
+		"udp" : "frame");
+
+	unlock_devs(hwedev);
+
+	return ret;
+}
+
+static ssize_t match_store(struct hwe_dev * hwedev,
+	struct dev_attribute * attr, const char * buf, size_t count)
+{
+	bool udp;
+
+	if (sysfs_streq(buf, "udp"))
+		udp = true;
+	else
+	if (sysfs_streq(buf, "frame"))
+		udp = false;
+	else
+		return -EINVAL;
+
+	lock_devs(hwedev);
+	WRITE_ONCE(hwe_get_dev_priv(hwedev)->match_udp, udp);
+	unlock_devs(hwedev);
+
+	return count;
+}
+
+HWE_DEV_ATTR_RW(match);
+
+HWE_DEV_ATTR_UINT(match_offset, 0xffff);
+
+static struct attribute * net_dev_attrs[] = {
+	&hwe_attr_match.attr,
+	&hwe_attr_match_offset.attr,
+	NULL
+};
+
+static const struct attribute_group net_dev_group = {
+	.attrs = net_dev_attrs,
+};
+
+/*! Network device settings. */
+const struct attribute_group * hwe_net_dev_groups[] = {
+	&net_dev_group,
+	NULL
+};
+
 static void hwenet_init(struct net_device *ndev)
 {
 	struct hwe_dev_priv *priv;
@@ -93,11 +1355,22 @@ static void hwenet_init(struct net_device *ndev)
 	ether_setup(ndev);
 
 	ndev->netdev_ops = &hwe_netdev_ops;
+	ndev->ethtool_ops = &hwe_ethtool_ops;
 	ndev->flags |= IFF_NOARP;
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(4, 10, 0))
 	ndev->max_mtu = 4 * 1024;
 #endif
-	ndev->features |= NETIF_F_HW_CSUM;
+	/* Fragmented and GSO packets are matched as they are, through
+	 * skb_seq_read() (see lookup()): a large send reaches us in one
+	 * piece and is a single request, headers included, rather than
+	 * the segments the stack would otherwise make of it. */
+	ndev->features |= NETIF_F_HW_CSUM | NETIF_F_SG | NETIF_F_FRAGLIST |
+		NETIF_F_HIGHDMA | NETIF_F_GSO_SOFTWARE;
+	ndev->hw_features |= NETIF_F_SG | NETIF_F_GSO_SOFTWARE;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0))
+	ndev->xdp_features = NETDEV_XDP_ACT_BASIC | NETDEV_XDP_ACT_REDIRECT |
+		NETDEV_XDP_ACT_NDO_XMIT;
+#endif
 
 	priv = netdev_priv(ndev);
 
@@ -105,19 +1378,71 @@ static void hwenet_init(struct net_device *ndev)
 	list_add(&priv->devices, &devices);
 }
 
-/*! Create an instance of the network device.
- */
-struct hwe_dev_priv * hwe_create_net_device(struct hwe_dev * hwedev, long index)
+/* Spreads the online CPUs over the TX queues, so that a sender
+ * keeps using the queue (and thus the NAPI instance) of its CPU. */
+static void set_xps(struct hwe_dev_priv *priv)
+{
+#ifdef CONFIG_XPS
+	cpumask_var_t mask;
+	unsigned i;
+
+	if (!zalloc_cpumask_var(&mask, GFP_KERNEL))
+		return;
+
+	for (i = 0; i < priv->queue_count; i++) {
+		unsigned cpu;
+		unsigned n = 0;
+
+		cpumask_clear(mask);
+
+		for_each_online_cpu(cpu)
+			if (n++ % priv->queue_count == i)
+				cpumask_set_cpu(cpu, mask);
+
+		netif_set_xps_queue(priv->net_dev, mask, i);
+	}
+
+	free_cpumask_var(mask);
+#endif
+}
+
+static void del_queues(struct hwe_dev_priv *priv)
+{
+	unsigned i;
+
+	for (i = 0; i < priv->queue_count; i++) {
+		/* in case the timer queued something after the device was stopped */
+		purge_rx_ring(&priv->queues[i]);
+#ifdef HWENET_XDP
+		if (xdp_rxq_info_is_reg(&priv->queues[i].xdp_rxq))
+			xdp_rxq_info_unreg(&priv->queues[i].xdp_rxq);
+#endif
+		netif_napi_del(&priv->queues[i].napi);
+	}
+
+	kfree(priv->queues);
+}
+
+/* Creates a network device named \a name (or hwenetN if \a name is
+ * empty) and brings it up if \a up is set. */
+static struct hwe_dev_priv * new_net_device(struct hwe_dev * hwedev, long index,
+	const char * name, bool up)
 {
 	struct net_device *ndev;
 	struct hwe_dev_priv *priv;
+	unsigned nq = num_online_cpus();
+	unsigned i;
 	int err;
 
-	ndev = alloc_netdev(sizeof(struct hwe_dev_priv),
-		NET_DRIVER_NAME"%d", NET_NAME_UNKNOWN, hwenet_init);
+	if (*name)
+		ndev = alloc_netdev_mqs(sizeof(struct hwe_dev_priv), name,
+			NET_NAME_USER, hwenet_init, nq, nq);
+	else
+		ndev = alloc_netdev_mqs(sizeof(struct hwe_dev_priv),
+			NET_DRIVER_NAME"%d", NET_NAME_UNKNOWN, hwenet_init, nq, nq);
 
 	if (!ndev) {
-		pr_err("%s%ld: alloc_netdev() failed\n", NET_DRIVER_NAME,
+		pr_err("%s%ld: alloc_netdev_mqs() failed\n", NET_DRIVER_NAME,
 			index);
 		return NULL;
 	}
@@ -126,29 +1451,282 @@ struct hwe_dev_priv * hwe_create_net_device(struct hwe_dev * hwedev, long index)
 
 	priv->index = index;
 	priv->hwedev = hwedev;
+	priv->queues = kcalloc(nq, sizeof(*priv->queues), GFP_KERNEL);
+	priv->stats = netdev_alloc_pcpu_stats(struct hwenet_stats);
+	priv->endpoints = kcalloc(HWENET_ENDPOINT_BUCKETS,
+		sizeof(*priv->endpoints), GFP_KERNEL);
+
+	if (!priv->queues || !priv->stats || !priv->endpoints) {
+		pr_err("%s%ld: out of memory\n", NET_DRIVER_NAME, index);
+		list_del(&priv->devices);
+		kfree(priv->endpoints);
+		kfree(priv->queues);
+		free_percpu(priv->stats);
+		free_netdev(ndev);
+		return NULL;
+	}
+
+	for (i = 0, err = 0; i < nq && !err; i++) {
+		struct hwenet_queue *q = &priv->queues[i];
+
+		q->priv = priv;
+		spin_lock_init(&q->rx_lock);
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(6, 1, 0))
+		netif_napi_add(ndev, &q->napi, hwenet_poll, NAPI_POLL_WEIGHT);
+#else
+		netif_napi_add(ndev, &q->napi, hwenet_poll);
+#endif
+		/* del_queues() cleans up as many queues */
+		priv->queue_count++;
+#ifdef HWENET_XDP
+		err = xdp_rxq_info_reg(&q->xdp_rxq, ndev, i, q->napi.napi_id);
+
+		if (!err)
+			err = xdp_rxq_info_reg_mem_model(&q->xdp_rxq,
+				MEM_TYPE_PAGE_SHARED, NULL);
+
+		if (err)
+			pr_err("%s%ld: xdp_rxq_info_reg() failed (error code %d)\n",
+				NET_DRIVER_NAME, index, err);
+#endif
+	}
 
-	err = register_netdev(ndev);
+	if (!err) {
+		err = register_netdev(ndev);
+
+		if (err)
+			pr_err("%s%ld: register_netdev() failed (error code %d)\n",
+				NET_DRIVER_NAME, index, err);
+	}
 
 	if (err) {
-		pr_err("%s%ld: register_netdev() failed (error code %d)\n",
-			NET_DRIVER_NAME, index, err);
 		list_del(&priv->devices);
+		del_queues(priv);
+		free_percpu(priv->stats);
+		kfree(priv->endpoints);
 		free_netdev(ndev);
 		return NULL;
 	}
 
+	set_xps(priv);
+
+	if (up) {
+		/* the device is usable even if it can't be brought up */
+		rtnl_lock();
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0))
+		err = dev_open(ndev);
+#else
+		err = dev_open(ndev, NULL);
+#endif
+		rtnl_unlock();
+
+		if (err)
+			pr_err("%s%ld: dev_open() failed (error code %d)\n",
+				NET_DRIVER_NAME, index, err);
+	}
+
 	return priv;
 }
 
+static struct hwe_dev_priv * new_endpoint(struct hwe_dev * hwedev, long index,
+	struct hwe_dev_priv * parent, const struct hwenet_addr * addr)
+{
+	struct hwe_dev_priv * ep;
+
+	rcu_read_lock();
+	ep = find_endpoint(parent, addr->bytes, addr->len);
+	rcu_read_unlock();
+
+	if (ep) {
+		pr_err("%s%ld: %s%ld already has an endpoint with this address\n",
+			NET_DRIVER_NAME, index, NET_DRIVER_NAME, parent->index);
+		return NULL;
+	}
+
+	if (!(ep = kzalloc(sizeof(*ep), GFP_KERNEL))) {
+		pr_err("%s%ld: out of memory\n", NET_DRIVER_NAME, index);
+		return NULL;
+	}
+
+	ep->hwedev = hwedev;
+	ep->index = index;
+	ep->is_endpoint = true;
+	ep->parent = parent;
+	ep->addr = *addr;
+
+	hlist_add_head_rcu(&ep->endpoint,
+		endpoint_bucket(parent, addr->bytes, addr->len));
+	WRITE_ONCE(parent->endpoint_count, parent->endpoint_count + 1);
+	list_add(&ep->devices, &devices);
+
+	return ep;
+}
+
+/* Returns the network device (not an endpoint) named \a name, e.g. net0. */
+static struct hwe_dev_priv * find_net_device(const char * name)
+{
+	struct hwe_dev_priv * priv;
+
+	list_for_each_entry (priv, &devices, devices) {
+		char s[32];
+
+		snprintf(s, sizeof(s), "%s%ld", iface_to_str(HWE_NET), priv->index);
+
+		if (!priv->is_endpoint && strcmp(s, name) == 0)
+			return priv;
+	}
+
+	return NULL;
+}
+
+static bool parse_addr(const char * s, bool mac, struct hwenet_addr * addr)
+{
+	if (mac) {
+		addr->len = ETH_ALEN;
+		return mac_pton(s, addr->bytes);
+	}
+
+	if (in4_pton(s, -1, addr->bytes, -1, NULL)) {
+		addr->len = 4;
+		return true;
+	}
+
+	if (in6_pton(s, -1, addr->bytes, -1, NULL)) {
+		addr->len = 16;
+		return true;
+	}
+
+	return false;
+}
+
+/*! Create an instance of the network device.
+ *
+ * The option `name=`*ifname* sets the name of the network device
+ * and the option `up` brings it up. With the options `parent=`*device*
+ * and either `mac=`*address* or `ip=`*address*, an endpoint of the
+ * network device *device* is created instead.
+ */
+struct hwe_dev_priv * hwe_create_net_device(struct hwe_dev * hwedev, long index,
+	const char * options)
+{
+	struct hwe_dev_priv * parent = NULL;
+	struct hwenet_addr addr = { 0 };
+	char ifname[IFNAMSIZ] = "";
+	bool up = false;
+	char name[16];
+	char value[64];
+	const char * s = options;
+
+	while (!!(s = hwe_next_option(s, name, sizeof(name), value, sizeof(value)))) {
+		if (strcmp(name, "parent") == 0) {
+			if (!(parent = find_net_device(value))) {
+				pr_err("%s%ld: no network device %s\n",
+					NET_DRIVER_NAME, index, value);
+				return NULL;
+			}
+		}
+		else
+		if (strcmp(name, "name") == 0) {
+			if (!dev_valid_name(value)) {
+				pr_err("%s%ld: invalid interface name: %s\n",
+					NET_DRIVER_NAME, index, value);
+				return NULL;
+			}
+
+			strscpy(ifname, value, sizeof(ifname));
+		}
+		else
+		if (strcmp(name, "up") == 0)
+			up = true;
+		else
+		if (strcmp(name, "mac") == 0 || strcmp(name, "ip") == 0) {
+			if (addr.len || !parse_addr(value, name[0] == 'm', &addr)) {
+				pr_err("%s%ld: invalid endpoint address: %s\n",
+					NET_DRIVER_NAME, index, value);
+				return NULL;
+			}
+		}
+		else {
+			pr_err("%s%ld: unknown option: %s\n",
+				NET_DRIVER_NAME, index, name);
+			return NULL;
+		}
+	}
+
+	if (!parent != !addr.len) {
+		pr_err("%s%ld: an endpoint needs a parent and an address\n",
+			NET_DRIVER_NAME, index);
+		return NULL;
+	}
+
+	if (parent && (*ifname || up)) {
+		pr_err("%s%ld: an endpoint has no network device to name or bring up\n",
+			NET_DRIVER_NAME, index);
+		return NULL;
+	}
+
+	if (parent)
+		return new_endpoint(hwedev, index, parent, &addr);
+
+	return new_net_device(hwedev, index, ifname, up);
+}
+
 /*! Destroy an instance of the network device.
  */
 void hwe_destroy_net_device(struct hwe_dev_priv * device)
 {
+	struct hwe_dev_priv * ep;
+	struct hlist_node * tmp;
+	unsigned i;
+
 	list_del(&device->devices);
+
+	if (device->is_endpoint) {
+		struct hwe_dev_priv * parent = device->parent;
+
+		if (parent) {
+			hlist_del_rcu(&device->endpoint);
+			WRITE_ONCE(parent->endpoint_count,
+				parent->endpoint_count - 1);
+		}
+
+		/* the transmission path may still be looking at it */
+		kfree_rcu(device, rcu);
+		return;
+	}
+
 	unregister_netdev(device->net_dev);
+
+	/* nothing is transmitted any more; the endpoints stay
+	 * without a network device */
+	for (i = 0; i < HWENET_ENDPOINT_BUCKETS; i++)
+		hlist_for_each_entry_safe (ep, tmp, &device->endpoints[i], endpoint) {
+			hlist_del(&ep->endpoint);
+			ep->parent = NULL;
+		}
+
+	del_queues(device);
+	free_percpu(device->stats);
+	kfree(device->endpoints);
 	free_netdev(device->net_dev);
 }
 
+/*! Write the name of the network interface of the network device,
+ * or of the parent of an endpoint; there is no node under /dev.
+ */
+int hwe_net_device_node(struct hwe_dev_priv * device, char * buf, size_t size)
+{
+	if (device->is_endpoint)
+		device = device->parent;
+
+	if (!device) {
+		*buf = 0;
+		return 0;
+	}
+
+	return snprintf(buf, size, "%s", device->net_dev->name);
+}
+
 /*! Initialize the network device emulator.
  */
 int hwe_init_net(void)
@@ -182,5 +1760,18 @@ void hwe_cleanup_net(void)
 
 void hwe_net_async_rx(struct hwe_dev_priv * device, struct hwe_pair * pair)
 {
-	send_response(device->net_dev, pair->resp, pair->resp_size);
+	struct hwenet_queue *q;
+
+	/* an endpoint sends its frames through its network device */
+	if (device->is_endpoint && !(device = device->parent))
+		return;
+
+	if (!netif_running(device->net_dev))
+		return;
+
+	/* deliver on the CPU the timer is running on */
+	q = &device->queues[smp_processor_id() % device->queue_count];
+	STATS_INC(device, async);
+	get_pair(pair);
+	queue_rx(q, pair, NULL);
 }
@@ -12,6 +12,13 @@
 #include <linux/uaccess.h>
 #include <linux/spi/spi.h>
 #include <linux/version.h>
+#include <linux/math64.h>
+#include <linux/kmod.h>
+#include <linux/device.h>
+#include <linux/string.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/wait.h>
 
 #include <linux/of.h>
 #include <linux/platform_device.h>
@@ -25,63 +32,160 @@
 
 #endif
 
+/*! Minimum clock speed of the timed transfers: a slower speed would
+ * only stall the client, so it is raised to this one */
+#define SPI_MIN_SPEED_HZ	10000
+
+/*! Maximum chip select setup and hold times: 1 ms */
+#define SPI_MAX_CS_DELAY_NS	NSEC_PER_MSEC
+
+/*! Emulated SPI controller, shared by several devices,
+ * each with its own chip select */
+struct hwe_spi_ctlr {
+	struct spi_master *master;
+	unsigned dev_count;
+};
+
 /*! Private data for the SPI device */
 struct hwe_dev_priv {
+	bool in_use;
+	/* The messages take this lock instead of the interface lock, only
+	 * to look at in_use and resp, which the timer updates too, and to
+	 * count themselves; the settings are read without it */
+	spinlock_t lock;
+	unsigned msgs;	/* in progress */
+	wait_queue_head_t idle;
 	struct hwe_dev * hwedev;
 	struct list_head devices;
-	struct spi_master *master;
+	struct hwe_spi_ctlr *ctlr;
 	struct spi_device *spi_dev;
 	long index;
-	u8 resp[HWE_MAX_RESPONSE];
-	u8 * resp_ptr;
-	size_t resp_size;
-	bool async;
+	struct hwe_resp resp;
+	/* settings */
+	bool full_duplex;
+	unsigned turnaround;
+	bool timing;
+	unsigned cs_setup_ns;
+	unsigned cs_hold_ns;
+	/* full_duplex has changed; the request is reset by the next
+	 * message */
+	bool mode_changed;
+	/* Request being shifted in; in full-duplex mode, this state is
+	 * reset whenever the chip select is released. The SPI core passes
+	 * one message of the controller at a time, so only that message
+	 * looks at it, without the lock. */
+	u8 req[HWE_MAX_REQUEST];
+	size_t req_size;
+	size_t pos;
+	size_t resp_start;
+	bool matched;
 };
 
 static struct list_head devices;
 static struct platform_device * plat_device;
 
-static int hwespi_transfer_one(struct spi_controller *ctlr, struct spi_device *spi,
-			    struct spi_transfer *transfer)
+/* the spidev driver has been loaded (see bind_spidev()) */
+static bool spidev_requested;
+
+/* Matches the request collected so far and makes its response,
+ * if any, pending. */
+static void end_request(struct spi_controller *ctlr, struct hwe_dev_priv *dev)
 {
-	struct hwe_dev_priv *dev = spi_controller_get_devdata(ctlr);
 	struct hwe_pair *pair = NULL;
+	bool pending;
+
+	if (!dev->req_size)
+		return;
 
-	if (transfer->tx_buf) {
-		pair = find_response(dev->hwedev, transfer->tx_buf, transfer->len);
+	/* the request was too long to be matched, if req_size < pos */
+	if (dev->req_size == dev->pos) {
+		/* the pairs may change while we search them */
+		rcu_read_lock();
 
-		hwe_log_request(HWE_SPI, dev->index, transfer->tx_buf,
-			transfer->len, !!pair);
+		pair = find_response(dev->hwedev, dev->req, dev->req_size);
+
+		if (pair && !try_get_pair(pair))
+			pair = NULL;
+
+		rcu_read_unlock();
+	}
+
+	hwe_log_request(HWE_SPI, dev->index, dev->req, dev->req_size, !!pair);
+
+	spin_lock_bh(&dev->lock);
+
+	pending = hwe_resp_pending(&dev->resp);
+
+	if (pair)
+		hwe_resp_set(&dev->resp, pair, false);
+	else
+		hwe_resp_clear(&dev->resp);
+
+	spin_unlock_bh(&dev->lock);
+
+	if (pending)
+		dev_err_ratelimited(&ctlr->dev, "new request arrived "
+			"while previous one is pending; "
+			"possible data loss\n");
+
+	if (pair)
+		put_pair(pair);
+
+	dev->req_size = 0;
+	dev->pos = 0;
+}
+
+/* Half-duplex transfer: consecutive transmit-only transfers, e.g.
+ * command, address and dummy phases, make up a single request; the
+ * response is read by subsequent receive-only transfers, either in
+ * the same message or in the following ones. */
+static void do_half_duplex(struct spi_controller *ctlr, struct hwe_dev_priv *dev,
+			    struct spi_transfer *transfer)
+{
+	if (transfer->tx_buf && !transfer->rx_buf) {
+		/* writing*/
 
-		if (dev->resp_size)
-			dev_err_ratelimited(&ctlr->dev, "new request arrived "
-				"while previous one is pending; "
-				"possible data loss\n");
+		size_t n = min_t(size_t, transfer->len,
+			HWE_MAX_REQUEST - dev->req_size);
+
+		memcpy(dev->req + dev->req_size, transfer->tx_buf, n);
+		dev->req_size += n;
+		dev->pos += transfer->len;
+
+		return;
 	}
 
+	end_request(ctlr, dev);
+
 	if (transfer->rx_buf && transfer->tx_buf) {
 		/* reading & writing */
 
-		dev->resp_size = 0;
+		hwe_log_request(HWE_SPI, dev->index, transfer->tx_buf,
+			transfer->len, false);
+
+		spin_lock_bh(&dev->lock);
+		hwe_resp_clear(&dev->resp);
+		spin_unlock_bh(&dev->lock);
 
-		dev_dbg_ratelimited(&ctlr->dev, "attempt to read %d byte(s)\n",
-			transfer->len);
+		dev_dbg_ratelimited(&ctlr->dev, "attempt to read %d byte(s) "
+			"in half-duplex mode\n", transfer->len);
 		memset(transfer->rx_buf, 0, transfer->len);
 	}
 	else
-	if (transfer->rx_buf && !transfer->tx_buf) {
+	if (transfer->rx_buf) {
 		/* reading */
+		struct hwe_pair *pair;
+		size_t pos, sz;
 
-		if (dev->resp_size) {
-			size_t sz = dev->resp_size > transfer->len ?
-				transfer->len : dev->resp_size;
-
-			memcpy(transfer->rx_buf, dev->resp_ptr, sz);
+		/* FIXME Do we need to support reading in chunks
+		 * of sizes less than the response size? */
+		spin_lock_bh(&dev->lock);
+		pair = hwe_resp_take(&dev->resp, transfer->len, &pos, &sz);
+		spin_unlock_bh(&dev->lock);
 
-			/* FIXME Do we need to support reading in chunks
-			 * of sizes less than resp_size? */
-			dev->resp_size -= sz;
-			dev->resp_ptr += sz;
+		if (pair) {
+			memcpy(transfer->rx_buf, pair->resp + pos, sz);
+			put_pair(pair);
 
 			hwe_log_response(HWE_SPI, dev->index, transfer->rx_buf, transfer->len);
 
@@ -94,58 +198,334 @@ static int hwespi_transfer_one(struct spi_controller *ctlr, struct spi_device *s
 		}
 
 	}
-	else
-	if (!transfer->rx_buf && transfer->tx_buf) {
-		/* writing*/
+}
+
+/* Full-duplex transfer: the bytes shifted in while the chip select
+ * is active make up the request; as soon as they match a pair, its
+ * response is shifted out, starting `turnaround` bytes after the
+ * end of the request. The request and the response may span several
+ * transfers, e.g. a command transfer followed by a data transfer. */
+static void do_full_duplex(struct hwe_dev_priv *dev, struct spi_transfer *transfer)
+{
+	const u8 *tx = transfer->tx_buf;
+	u8 *rx = transfer->rx_buf;
+	size_t len = transfer->len;
+
+	if (!dev->matched && dev->req_size < HWE_MAX_REQUEST) {
+		size_t n = min_t(size_t, len, HWE_MAX_REQUEST - dev->req_size);
+		struct hwe_pair *pair;
+
+		/* without a tx buffer, zeroes are shifted out */
+		if (tx)
+			memcpy(dev->req + dev->req_size, tx, n);
+		else
+			memset(dev->req + dev->req_size, 0, n);
+
+		dev->req_size += n;
+
+		rcu_read_lock();
+
+		pair = find_response_prefix(dev->hwedev, dev->req, dev->req_size);
+
+		if (pair && !try_get_pair(pair))
+			pair = NULL;
+
+		rcu_read_unlock();
 
 		if (pair) {
-			memcpy(dev->resp, pair->resp, pair->resp_size);
-			dev->resp_size = pair->resp_size;
-			dev->resp_ptr = dev->resp;
-			dev->async = false;
+			hwe_log_request(HWE_SPI, dev->index, dev->req,
+				pair->req_size, true);
+
+			spin_lock_bh(&dev->lock);
+			hwe_resp_set(&dev->resp, pair, false);
+			spin_unlock_bh(&dev->lock);
+
+			dev->resp_start = pair->req_size + dev->turnaround;
+			dev->matched = true;
+			put_pair(pair);
 		}
-		else
-			dev->resp_size = 0;
 	}
 
-	spi_finalize_current_transfer(ctlr);
+	if (rx)
+		memset(rx, 0, len);
+
+	if (dev->resp_start < dev->pos + len) {
+		size_t skip = dev->resp_start > dev->pos ?
+			dev->resp_start - dev->pos : 0;
+		struct hwe_pair *pair;
+		size_t pos, n;
+
+		/* the response bytes are consumed even if nobody
+		 * receives them */
+		spin_lock_bh(&dev->lock);
+		pair = hwe_resp_take(&dev->resp, len - skip, &pos, &n);
+		spin_unlock_bh(&dev->lock);
+
+		if (pair && rx) {
+			memcpy(rx + skip, pair->resp + pos, n);
+			hwe_log_response(HWE_SPI, dev->index, rx + skip, n);
+		}
+
+		if (pair)
+			put_pair(pair);
+	}
+
+	dev->pos += len;
+}
+
+/* Drops the request being shifted in, if any. */
+static void reset_request(struct hwe_dev_priv *dev)
+{
+	if (!dev->matched && dev->req_size)
+		hwe_log_request(HWE_SPI, dev->index, dev->req,
+			dev->req_size, false);
+
+	dev->req_size = 0;
+	dev->pos = 0;
+	dev->resp_start = 0;
+	dev->matched = false;
+}
+
+/* Resets the full-duplex state, which lasts while the chip select
+ * is active. */
+static void end_full_duplex(struct hwe_dev_priv *dev)
+{
+	reset_request(dev);
+
+	spin_lock_bh(&dev->lock);
+	hwe_resp_clear(&dev->resp);
+	spin_unlock_bh(&dev->lock);
+}
+
+/* Returns true if the chip select is released after the transfer. */
+static bool is_cs_released(struct spi_message *msg, struct spi_transfer *transfer)
+{
+	/* cs_change means the opposite for the last transfer */
+	if (list_is_last(&transfer->transfer_list, &msg->transfers))
+		return !transfer->cs_change;
+
+	return transfer->cs_change;
+}
+
+/* Returns the time it takes to clock the transfer through the bus. */
+static u64 transfer_time_ns(struct spi_device *spi, struct spi_transfer *transfer)
+{
+	u32 speed = transfer->speed_hz ? transfer->speed_hz : spi->max_speed_hz;
+	unsigned bpw = transfer->bits_per_word ? transfer->bits_per_word :
+		spi->bits_per_word;
+	unsigned word_size;
+
+	if (!speed)
+		return 0;
+
+	if (speed < SPI_MIN_SPEED_HZ)
+		speed = SPI_MIN_SPEED_HZ;
+
+	if (!bpw)
+		bpw = 8;
+
+	/* words are stored in 1, 2 or 4 bytes */
+	word_size = bpw <= 8 ? 1 : bpw <= 16 ? 2 : 4;
+
+	return div_u64((u64)(transfer->len / word_size) * bpw * NSEC_PER_SEC,
+		speed);
+}
+
+/* We handle whole messages rather than single transfers, which spares
+ * us the per-transfer overhead of the SPI core (chip select toggling,
+ * waiting for completion, etc). There's no real hardware here, so the
+ * chip select is purely virtual. */
+static int hwespi_transfer_one_message(struct spi_controller *ctlr,
+			    struct spi_message *msg)
+{
+	struct hwe_dev_priv *dev = msg->spi->controller_data;
+	struct spi_transfer *transfer;
+	bool cs_setup = true;
+	bool full_duplex, reset;
+	u64 delay_ns = 0;
+
+	/* Not the interface lock: the device is removed under it, and the
+	 * removal waits for spidev, which may be waiting for this message.
+	 * The device is marked unused under its lock before removal, and
+	 * its private data may be reused by another SPI device since; once
+	 * it is either, the message isn't handled. Otherwise, the removal
+	 * waits for the message (see wait_msgs()). */
+	spin_lock_bh(&dev->lock);
+
+	if (!dev->in_use || dev->spi_dev != msg->spi) {
+		spin_unlock_bh(&dev->lock);
+		msg->status = -ENODEV;
+		goto quit;
+	}
+
+	dev->msgs++;
+	full_duplex = dev->full_duplex;
+	reset = dev->mode_changed;
+	dev->mode_changed = false;
+
+	spin_unlock_bh(&dev->lock);
+
+	if (reset)
+		reset_request(dev);
+
+	list_for_each_entry (transfer, &msg->transfers, transfer_list) {
+		bool cs_released = is_cs_released(msg, transfer);
+
+		if (full_duplex) {
+			do_full_duplex(dev, transfer);
+
+			if (cs_released)
+				end_full_duplex(dev);
+		}
+		else {
+			do_half_duplex(ctlr, dev, transfer);
+
+			if (cs_released)
+				end_request(ctlr, dev);
+		}
+
+		if (READ_ONCE(dev->timing)) {
+			if (cs_setup)
+				delay_ns += READ_ONCE(dev->cs_setup_ns);
+
+			delay_ns += transfer_time_ns(msg->spi, transfer);
+
+			if (cs_released)
+				delay_ns += READ_ONCE(dev->cs_hold_ns);
+		}
+
+		cs_setup = cs_released;
+
+		msg->actual_length += transfer->len;
+	}
+
+	spin_lock_bh(&dev->lock);
+
+	/* under the lock, so that the waiter is done with the device
+	 * only once we are */
+	if (!--dev->msgs)
+		wake_up(&dev->idle);
+
+	spin_unlock_bh(&dev->lock);
+
+	/* the message completes when it would on a real bus */
+	if (delay_ns)
+		hwe_delay_ns(delay_ns);
+
+	msg->status = 0;
+quit:
+	spi_finalize_current_message(ctlr);
 
 	return 0;
 }
 
+static ssize_t full_duplex_show(struct hwe_dev * hwedev,
+	struct dev_attribute * attr, char * buf)
+{
+	ssize_t ret;
+
+	lock_devs(hwedev);
+
+	ret = sprintf(buf, "%d", hwe_get_dev_priv(hwedev)->full_duplex);
+
+	unlock_devs(hwedev);
+
+	return ret;
+}
+
+static ssize_t full_duplex_store(struct hwe_dev * hwedev,
+	struct dev_attribute * attr, const char * buf, size_t count)
+{
+	struct hwe_dev_priv * dev;
+	bool val;
+
+	if (kstrtobool(buf, &val))
+		return -EINVAL;
+
+	lock_devs(hwedev);
+
+	dev = hwe_get_dev_priv(hwedev);
+
+	spin_lock_bh(&dev->lock);
+
+	if (dev->full_duplex != val) {
+		/* don't let the pending response migrate
+		 * from one mode to another; the request is left to the
+		 * messages, which look at it without the lock */
+		hwe_resp_clear(&dev->resp);
+		dev->full_duplex = val;
+		dev->mode_changed = true;
+	}
+
+	spin_unlock_bh(&dev->lock);
+
+	unlock_devs(hwedev);
+
+	return count;
+}
+
+HWE_DEV_ATTR_RW(full_duplex);
+
+HWE_DEV_ATTR_UINT(turnaround, HWE_MAX_REQUEST);
+HWE_DEV_ATTR_UINT(timing, 1);
+HWE_DEV_ATTR_UINT(cs_setup_ns, SPI_MAX_CS_DELAY_NS);
+HWE_DEV_ATTR_UINT(cs_hold_ns, SPI_MAX_CS_DELAY_NS);
+
+static struct attribute * spi_dev_attrs[] = {
+	&hwe_attr_full_duplex.attr,
+	&hwe_attr_turnaround.attr,
+	&hwe_attr_timing.attr,
+	&hwe_attr_cs_setup_ns.attr,
+	&hwe_attr_cs_hold_ns.attr,
+	NULL
+};
+
+static const struct attribute_group spi_dev_group = {
+	.attrs = spi_dev_attrs,
+};
+
+/*! SPI device settings. */
+const struct attribute_group * hwe_spi_dev_groups[] = {
+	&spi_dev_group,
+	NULL
+};
+
+static struct hwe_spi_ctlr ctlrs[HWE_MAX_DEVICES];
+
+static unsigned spi_chipselects = 1;
+
 struct spi_board_info chip = {
 	/* In the past, we could assign modalias to "spidev".
 	 * These days, we could assign modalias to any fake device name
 	 * from the list supported by the spidev driver (see spidev
 	 * source code).
 	 * But the proper way would be to assign modalias to our own
-	 * name and then bind spidev to our devices. For details, see
-	 * https://docs.kernel.org/spi/spidev.html */
+	 * name and then bind spidev to our devices (see bind_spidev()).
+	 * For details, see https://docs.kernel.org/spi/spidev.html */
 	.modalias = "hwe_spi",
 };
 
-static struct hwe_dev_priv * new_dev(struct hwe_dev * hwedev, long index, struct platform_device *pdev)
+/* Returns the controller for the device with the given index,
+ * registering it first, if necessary. */
+static struct hwe_spi_ctlr * get_ctlr(long index, struct platform_device *pdev)
 {
-	struct hwe_dev_priv *ret;
+	struct hwe_spi_ctlr *ctlr = &ctlrs[index / spi_chipselects];
 	struct spi_master *master;
 	int err;
 
-	master = spi_alloc_master(&pdev->dev, sizeof(struct hwe_dev_priv));
+	if (ctlr->master)
+		return ctlr;
+
+	master = spi_alloc_master(&pdev->dev, 0);
 
 	if (master == NULL) {
 		pr_err("spi_alloc_master() failed\n");
 		return NULL;
 	}
 
-	ret = spi_controller_get_devdata(master);
+	master->num_chipselect = spi_chipselects;
 
-	ret->hwedev = hwedev;
-	ret->index = index;
-	ret->master = master;
-
-	master->num_chipselect = 1;
-
-	master->transfer_one = hwespi_transfer_one;
+	master->transfer_one_message = hwespi_transfer_one_message;
 
 	err = spi_register_master(master);
 
@@ -155,25 +535,184 @@ static struct hwe_dev_priv * new_dev(struct hwe_dev * hwedev, long index, struct
 		return NULL;
 	}
 
-	ret->spi_dev = spi_new_device(master, &chip);
+	ctlr->master = master;
+
+	return ctlr;
+}
+
+/* Unregisters the controller, if it has no more devices. */
+static void put_ctlr(struct hwe_spi_ctlr *ctlr)
+{
+	if (ctlr->dev_count)
+		return;
+
+	spi_unregister_master(ctlr->master);
+	ctlr->master = NULL;
+}
+
+/* Binds the spidev driver to \a spi, so that the device gets a node,
+ * /dev/spidevB.C. The modalias is our own (see chip), so we override
+ * the driver, as userspace could do through sysfs. The spidev driver
+ * is loaded along with the first device, unless it is built in. */
+static void bind_spidev(struct spi_device * spi)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0))
+	int err;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0))
+	err = driver_set_override(&spi->dev, &spi->driver_override,
+		"spidev", strlen("spidev"));
+#else
+	err = (spi->driver_override = kstrdup("spidev", GFP_KERNEL)) ?
+		0 : -ENOMEM;
+#endif
+
+	if (err) {
+		pr_err("%s: couldn't override the driver (error code %d)\n",
+			dev_name(&spi->dev), err);
+		return;
+	}
+
+	/* binds it to the device, if loaded; tried again with the next
+	 * device if not */
+	if (!spidev_requested)
+		spidev_requested = !request_module("spidev");
+
+	if ((err = device_attach(&spi->dev)) < 0)
+		pr_err("%s: couldn't bind spidev (error code %d)\n",
+			dev_name(&spi->dev), err);
+#else
+	pr_warn_once("spidev can't be bound to SPI devices before kernel 4.20\n");
+#endif
+}
+
+static struct hwe_dev_priv * find_unused_dev(void)
+{
+	struct hwe_dev_priv * dev;
+
+	list_for_each_entry (dev, &devices, devices)
+		if (!dev->in_use)
+			return dev;
+	return NULL;
+}
+
+/* As with I2C, we never free the private data of a removed device
+ * until the driver is unloaded, since a message may still be on
+ * its way to the device. Instead, we reuse it for new devices: the
+ * messages in progress are over (see wait_msgs()), and a late one
+ * takes the lock, which is never reinitialized, to find the device
+ * unused or used by another SPI device. So the state is reset under
+ * the lock rather than cleared all at once. */
+static struct hwe_dev_priv * alloc_dev(struct hwe_dev * hwedev, long index)
+{
+	struct hwe_dev_priv * ret = find_unused_dev();
+
+	if (!ret) {
+		if (!(ret = kzalloc(sizeof(*ret), GFP_KERNEL)))
+			return ret;
+
+		spin_lock_init(&ret->lock);
+		init_waitqueue_head(&ret->idle);
+		list_add(&ret->devices, &devices);
+	}
+
+	spin_lock_bh(&ret->lock);
+
+	ret->hwedev = hwedev;
+	ret->index = index;
+	ret->ctlr = NULL;
+	ret->spi_dev = NULL;
+	hwe_resp_clear(&ret->resp);
+	ret->full_duplex = false;
+	ret->turnaround = 0;
+	ret->timing = false;
+	ret->cs_setup_ns = 0;
+	ret->cs_hold_ns = 0;
+	ret->mode_changed = false;
+	ret->req_size = 0;
+	ret->pos = 0;
+	ret->resp_start = 0;
+	ret->matched = false;
+
+	spin_unlock_bh(&ret->lock);
+
+	return ret;
+}
+
+static bool no_msgs(struct hwe_dev_priv * dev)
+{
+	bool ret;
+
+	spin_lock_bh(&dev->lock);
+	ret = !dev->msgs;
+	spin_unlock_bh(&dev->lock);
+
+	return ret;
+}
+
+/* Waits for the messages in progress on \a dev, which has been marked
+ * unused. */
+static void wait_msgs(struct hwe_dev_priv * dev)
+{
+	wait_event(dev->idle, no_msgs(dev));
+}
+
+static struct hwe_dev_priv * new_dev(struct hwe_dev * hwedev, long index, struct platform_device *pdev)
+{
+	struct hwe_dev_priv *ret;
+	struct hwe_spi_ctlr *ctlr;
+	struct spi_device *spi;
+	struct spi_board_info info = chip;
+
+	if (!(ret = alloc_dev(hwedev, index))) {
+		pr_err("%s%ld: device not created; out of memory!\n",
+			iface_to_str(HWE_SPI), index);
+		return NULL;
+	}
+
+	if (!(ctlr = get_ctlr(index, pdev)))
+		return NULL;
+
+	ret->ctlr = ctlr;
+
+	info.chip_select = index % spi_chipselects;
+	info.controller_data = ret;
+
+	spi = spi_new_device(ctlr->master, &info);
 
-	if (!ret->spi_dev) {
+	if (!spi) {
 		pr_err("spi_new_device() failed\n");
-		spi_master_put(master);
+		put_ctlr(ctlr);
 		return NULL;
 	}
 
-	list_add(&ret->devices, &devices);
+	ctlr->dev_count++;
+
+	spin_lock_bh(&ret->lock);
+	ret->spi_dev = spi;
+	ret->in_use = true;
+	spin_unlock_bh(&ret->lock);
+
+	bind_spidev(ret->spi_dev);
 
 	return ret;
 }
 
 void del_dev(struct hwe_dev_priv * device)
 {
-	list_del(&device->devices);
+	/* no new messages from now on */
+	spin_lock_bh(&device->lock);
+	device->in_use = false;
+	spin_unlock_bh(&device->lock);
+
+	wait_msgs(device);
 
 	spi_unregister_device(device->spi_dev);
-	spi_unregister_master(device->master);
+
+	hwe_resp_clear(&device->resp);
+
+	device->ctlr->dev_count--;
+	put_ctlr(device->ctlr);
 }
 
 static int plat_probe(struct platform_device *pdev)
@@ -203,10 +742,17 @@ static struct platform_driver plat_driver = {
 
 /*! Create an instance of the SPI device.
  */
-struct hwe_dev_priv * hwe_create_spi_device(struct hwe_dev * hwedev, long index)
+struct hwe_dev_priv * hwe_create_spi_device(struct hwe_dev * hwedev, long index,
+	const char * options)
 {
 	struct hwe_dev_priv *priv;
 
+	if (*options) {
+		pr_err("%s%ld: device not created; unsupported options: %s\n",
+			iface_to_str(HWE_SPI), index, options);
+		return NULL;
+	}
+
 	priv = new_dev(hwedev, index, plat_device);
 
 	return priv;
@@ -219,6 +765,24 @@ void hwe_destroy_spi_device(struct hwe_dev_priv * device)
 	del_dev(device);
 }
 
+/*! Write the name of the node of the SPI device, e.g. spidev0.0.
+ * The node is created by the spidev driver (see bind_spidev()), so
+ * the name is empty while spidev isn't bound to the device.
+ */
+int hwe_spi_device_node(struct hwe_dev_priv * device, char * buf, size_t size)
+{
+	struct device_driver * drv = device->spi_dev ?
+		READ_ONCE(device->spi_dev->dev.driver) : NULL;
+
+	if (!drv || strcmp(drv->name, "spidev")) {
+		*buf = 0;
+		return 0;
+	}
+
+	return snprintf(buf, size, "spidev%d.%u", device->ctlr->master->bus_num,
+		(unsigned)(device->index % spi_chipselects));
+}
+
 /*! Initialize the SPI device emulator.
  */
 int hwe_init_spi(void)
@@ -227,6 +791,12 @@ int hwe_init_spi(void)
 
 	pr_debug("loading spi driver\n");
 
+	if (!spi_chipselects || spi_chipselects > HWE_MAX_DEVICES) {
+		pr_err("spi_chipselects must be in range 1..%d\n",
+			HWE_MAX_DEVICES);
+		return -EINVAL;
+	}
+
 	INIT_LIST_HEAD(&devices);
 
 	plat_device =  platform_device_register_simple("hwe_plat",
@@ -260,7 +830,15 @@ void hwe_cleanup_spi(void)
 	list_for_each_safe(e, tmp, &devices) {
 		struct hwe_dev_priv * dev = list_entry(e, struct hwe_dev_priv, devices);
 
-		hwe_destroy_spi_device(dev);
+		/* sanity check */
+		if (dev->in_use) {
+			pr_err("%s%ld was not destroyed before driver unload!\n",
+				iface_to_str(HWE_SPI), dev->index);
+			hwe_destroy_spi_device(dev);
+		}
+
+		list_del(&dev->devices);
+		kfree(dev);
 	}
 
 	platform_driver_unregister(&plat_driver);
@@ -269,17 +847,20 @@ void hwe_cleanup_spi(void)
 	pr_info("spi driver unloaded\n");
 }
 
+module_param(spi_chipselects, uint, 0444);
+MODULE_PARM_DESC(spi_chipselects, "Number of devices (chip selects) per emulated SPI controller");
+
 void hwe_spi_async_rx(struct hwe_dev_priv * device, struct hwe_pair * pair)
 {
-	if (device->resp_size && (!device->async || device->resp_ptr != device->resp))
-		/* XXX overwrite asynchronous response IFF
-		 * 1) there is no pending response OR
-		 * 2) the pending response is asynchronous AND
-		 * 3) we haven't started reading it yet. */
-		return;
+	spin_lock(&device->lock);
+
+	/* XXX overwrite asynchronous response IFF
+	 * 1) there is no pending response OR
+	 * 2) the pending response is asynchronous AND
+	 * 3) we haven't started reading it yet. */
+	if (device->in_use && (!hwe_resp_pending(&device->resp) ||
+	    (device->resp.async && !device->resp.pos)))
+		hwe_resp_set(&device->resp, pair, true);
 
-	memcpy(device->resp, pair->resp, pair->resp_size);
-	device->resp_size = pair->resp_size;
-	device->resp_ptr = device->resp;
-	device->async = true;
+	spin_unlock(&device->lock);
 }
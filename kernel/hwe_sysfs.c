@@ -9,9 +9,12 @@
 #include <linux/slab.h>
 #include <linux/printk.h>
 #include <linux/ctype.h>
+#include <linux/string.h>
 #include <linux/version.h>
 #include <linux/bitmap.h>
+#include <linux/err.h>
 #include <linux/semaphore.h>
+#include <linux/rculist.h>
 
 #include "hwemu.h"
 
@@ -24,7 +27,8 @@ struct hwe_iface {
 	struct kobject kobj;
 	struct list_head dev_list;
 	struct semaphore sem;
-	DECLARE_BITMAP(dev_indexes, HWE_MAX_DEVICES);
+	/* large enough for any interface */
+	DECLARE_BITMAP(dev_indexes, HWE_MAX_NET_DEVICES);
 };
 
 #define to_iface(p) container_of(p, struct hwe_iface, kobj)
@@ -43,6 +47,8 @@ struct iface_attribute {
 /*! \brief Internal representation of a device */
 struct hwe_dev {
 	struct kobject kobj;
+	/* there may be lockless readers of the pair list */
+	struct rcu_head rcu;
 	struct list_head entry;
 	struct list_head pair_list;
 	enum HWE_IFACE iface;
@@ -50,6 +56,12 @@ struct hwe_dev {
 	struct hwe_dev_priv * device;
 	struct kobject * pairs_kobj;
 	DECLARE_BITMAP(pairs_indexes, HWE_MAX_PAIRS);
+	/* sizes of the requests of the pairs; see may_find_response() */
+	DECLARE_BITMAP(req_sizes, HWE_MAX_REQUEST + 1);
+	/* pairs to replace those of pair_list at once; see commit_pairs() */
+	struct list_head stage_list;
+	unsigned stage_count;
+	char label[HWE_MAX_LABEL + 1];
 };
 
 #define to_dev(p) container_of(p, struct hwe_dev, kobj)
@@ -59,6 +71,13 @@ struct hwe_dev_priv * hwe_get_dev_priv(struct hwe_dev * dev)
 	return dev->device;
 }
 
+/*! Returns the device whose directory is \a kobj, e.g. for the binary
+ * attributes of interfaces. */
+struct hwe_dev * hwe_kobj_to_dev(struct kobject * kobj)
+{
+	return to_dev(kobj);
+}
+
 enum HWE_IFACE hwe_get_dev_iface(struct hwe_dev * dev)
 {
 	return dev->iface;
@@ -69,27 +88,26 @@ long hwe_get_dev_index(struct hwe_dev * dev)
 	return dev->index;
 }
 
-/*! \brief `sysfs` attribute of a device */
-struct dev_attribute {
-	struct attribute attr;
-	ssize_t (*show)(struct hwe_dev * dev,
-		struct dev_attribute * attr, char * buf);
-	ssize_t (*store)(struct hwe_dev * dev,
-		struct dev_attribute * attr, const char * buf, size_t count);
-};
-
 #define to_dev_attr(p) container_of(p, struct dev_attribute, attr)
 
 /*! \brief Operations for each device */
 struct hwe_dev_ops {
-	struct hwe_dev_priv * (*create)(struct hwe_dev * dev, long index);
+	/* \a options are those written to the `add` file of the interface */
+	struct hwe_dev_priv * (*create)(struct hwe_dev * dev, long index,
+		const char * options);
 	void (*destroy)(struct hwe_dev_priv * device);
+	/* writes the name of the node of the device (see dev_node_show()) */
+	int (*node)(struct hwe_dev_priv * device, char * buf, size_t size);
+	/* interface-specific device attributes */
+	const struct attribute_group ** groups;
 };
 
 /* Prototypes for our internal device operations. */
 #define DECL_DEVOP(__upper, __lower) \
-	extern struct hwe_dev_priv * hwe_create_##__lower##_device(struct hwe_dev * dev, long index); \
+	extern struct hwe_dev_priv * hwe_create_##__lower##_device(struct hwe_dev * dev, long index, const char * options); \
 	extern void hwe_destroy_##__lower##_device(struct hwe_dev_priv * device); \
+	extern int hwe_##__lower##_device_node(struct hwe_dev_priv * device, char * buf, size_t size); \
+	extern const struct attribute_group * hwe_##__lower##_dev_groups[]; \
 
 HWE_FOREACH_IFACE(DECL_DEVOP)
 
@@ -99,6 +117,8 @@ HWE_FOREACH_IFACE(DECL_DEVOP)
 #define DEVOP(__upper, __lower) { \
 	.create = hwe_create_##__lower##_device, \
 	.destroy = hwe_destroy_##__lower##_device, \
+	.node = hwe_##__lower##_device_node, \
+	.groups = hwe_##__lower##_dev_groups, \
 },
 
 static const struct hwe_dev_ops dev_ops[] = {
@@ -156,9 +176,10 @@ static ssize_t iface_store(struct hwe_iface * iface,
 
 static inline long find_free_dev_index(enum HWE_IFACE iface)
 {
-	long ret = find_first_zero_bit(ifaces[iface].dev_indexes, HWE_MAX_DEVICES);
+	long max = HWE_MAX_IFACE_DEVICES(iface);
+	long ret = find_first_zero_bit(ifaces[iface].dev_indexes, max);
 
-	if (ret == HWE_MAX_DEVICES)
+	if (ret == max)
 		ret = -1;
 
 	return ret;
@@ -261,6 +282,7 @@ static struct hwe_dev * add_dev(enum HWE_IFACE iface, long index)
 		take_dev_index(iface, index);
 
 		INIT_LIST_HEAD(&ret->pair_list);
+		INIT_LIST_HEAD(&ret->stage_list);
 		list_add(&ret->entry, &ifaces[iface].dev_list);
 	}
 
@@ -277,6 +299,7 @@ static void del_dev(struct hwe_dev * dev)
 }
 
 static void clear_pairs(struct hwe_dev * dev);
+static void clear_stage(struct hwe_dev * dev);
 
 static void shutdown_dev(struct hwe_dev * dev)
 {
@@ -286,6 +309,7 @@ static void shutdown_dev(struct hwe_dev * dev)
 		dev_ops[dev->iface].destroy(dev->device);
 
 	clear_pairs(dev);
+	clear_stage(dev);
 
 	list_del(&dev->entry);
 	put_dev_index(dev->iface, dev->index);
@@ -299,7 +323,9 @@ static void shutdown_dev(struct hwe_dev * dev)
 /* forward declaration */
 static struct kobj_type dev_ktype;
 
-static struct hwe_dev * new_dev(enum HWE_IFACE iface) {
+/* The KOBJ_ADD uevent is up to the caller, so that the uevents of
+ * several new devices can be emitted together. */
+static struct hwe_dev * new_dev(enum HWE_IFACE iface, const char * options) {
 	struct hwe_iface * ifc = &ifaces[iface];
 	struct hwe_dev * ret = NULL;
 	long idx;
@@ -317,7 +343,7 @@ static struct hwe_dev * new_dev(enum HWE_IFACE iface) {
 		pr_err("%s%ld: device not created; out of memory!",
 			iface_to_str(iface), idx);
 	else
-	if (!(ret->device = dev_ops[iface].create(ret, idx))) {
+	if (!(ret->device = dev_ops[iface].create(ret, idx, options))) {
 		/* assume a log message was printed by create() */
 		del_dev(ret);
 		ret = NULL;
@@ -335,11 +361,54 @@ static struct hwe_dev * new_dev(enum HWE_IFACE iface) {
 		shutdown_dev(ret);
 		ret = NULL;
 	}
-	else {
+	else
+	if (!!(err = sysfs_create_groups(&ret->kobj, dev_ops[iface].groups))) {
+		pr_err("sysfs_create_groups() failed\n");
+		shutdown_dev(ret);
+		ret = NULL;
+	}
+
+	return ret;
+}
+
+/* Returns the device options in the data written to the `add` file of
+ * an interface, to be freed with kfree(). The data may start with the
+ * number of devices to create with these options, which is stored in
+ * \a dev_count (1 if there is none, 0 if it is invalid). The scripts
+ * have always written "1" there. */
+static char * get_dev_options(const char * buf, size_t count,
+	unsigned * dev_count)
+{
+	char * ret = kstrndup(buf, count, GFP_KERNEL);
+	char * s;
+	char * e;
+
+	if (!ret)
+		return NULL;
+
+	s = skip_spaces(ret);
+
+	for (e = s; isdigit((unsigned char)*e); e++)
+		;
+
+	*dev_count = 1;
 
-		kobject_uevent(&ret->kobj, KOBJ_ADD);
+	if (e != s && (!*e || isspace((unsigned char)*e))) {
+		char c = *e;
+
+		*e = 0;
+
+		if (kstrtouint(s, 10, dev_count))
+			*dev_count = 0;
+
+		*e = c;
+		s = e;
 	}
 
+	s = strim(s);
+
+	memmove(ret, s, strlen(s) + 1);
+
 	return ret;
 }
 
@@ -350,7 +419,10 @@ static ssize_t iface_add_store(struct hwe_iface * iface,
 	const char * iface_name = kobject_name(&iface->kobj);
 	const char * filename = attr->attr.name;
 	enum HWE_IFACE ifc;
-	struct hwe_dev * dev;
+	struct hwe_dev ** devs = NULL;
+	char * options = NULL;
+	unsigned dev_count;
+	unsigned i, n;
 
 	if (count == 0)
 		pr_err("%s/%s: empty write data\n",
@@ -359,37 +431,72 @@ static ssize_t iface_add_store(struct hwe_iface * iface,
 	if (!str_to_iface(iface_name, &ifc))
 		pr_err("%s/%s: unsupported interface: %s\n",
 			iface_name, filename, iface_name);
+	else
+	if (!(options = get_dev_options(buf, count, &dev_count)))
+		ret = -ENOMEM;
+	else
+	if (!dev_count || dev_count > HWE_MAX_IFACE_DEVICES(ifc)) {
+		pr_err("%s/%s: invalid number of devices\n",
+			iface_name, filename);
+		ret = -EINVAL;
+	}
+	else
+	if (!(devs = kcalloc(dev_count, sizeof(*devs), GFP_KERNEL)))
+		ret = -ENOMEM;
 	else {
 		lock_iface_devs(ifc);
 
-		if (!(dev = new_dev(ifc)))
-			pr_err("%s/%s: couldn't create new device with interface %s\n",
-				iface_name, filename, iface_name);
-		else {
-			ret = count;
+		for (n = 0; n < dev_count; n++) {
+			if (!(devs[n] = new_dev(ifc, options))) {
+				pr_err("%s/%s: couldn't create new device with interface %s\n",
+					iface_name, filename, iface_name);
+				break;
+			}
 
 			pr_debug("%s/%s: %s: new device created\n",
-				iface_name, filename, kobject_name(&dev->kobj));
+				iface_name, filename, kobject_name(&devs[n]->kobj));
 		}
 
+		/* Udev learns about the directories of a batch of devices
+		 * at once; the devices of the interface drivers (TTYs,
+		 * adapters, network devices) have had their own uevents
+		 * by now. The devices created before a failure are kept. */
+		for (i = 0; i < n; i++)
+			kobject_uevent(&devs[i]->kobj, KOBJ_ADD);
+
+		if (n == dev_count)
+			ret = count;
+
 		unlock_iface_devs(ifc);
 	}
 
+	kfree(devs);
+	kfree(options);
+
 	return ret;
 }
 
-long hwe_add_device(enum HWE_IFACE iface)
+/* \a node, if not NULL, receives the name of the node of the device,
+ * HWE_MAX_NODE_NAME characters at most. */
+long hwe_add_device(enum HWE_IFACE iface, char * node)
 {
 	struct hwe_dev * dev;
 	long ret;
 
 	lock_iface_devs(iface);
 
-	if (!(dev = new_dev(iface)))
+	if (!(dev = new_dev(iface, "")))
 		ret = -ENODEV;
-	else
+	else {
+		kobject_uevent(&dev->kobj, KOBJ_ADD);
+
 		ret = dev->index;
 
+		if (node)
+			dev_ops[iface].node(dev->device, node,
+				HWE_MAX_NODE_NAME + 1);
+	}
+
 	unlock_iface_devs(iface);
 
 	return ret;
@@ -560,6 +667,89 @@ static const struct sysfs_ops dev_sysfs_ops = {
 	.store = dev_attr_store,
 };
 
+static void pair_release(struct kref * ref)
+{
+	struct hwe_pair * pair = container_of(ref, struct hwe_pair, ref);
+
+	/* there may be lockless readers of the pair list */
+	kfree_rcu(pair, rcu);
+}
+
+/*! Takes a reference to \a pair, so that its data stays valid
+ * after the pair has been deleted from the list. */
+void get_pair(struct hwe_pair * pair)
+{
+	kref_get(&pair->ref);
+}
+
+/*! Same as get_pair(), but for pairs found without the device lock,
+ * i.e. under rcu_read_lock(). Returns false if the pair is being
+ * deleted. */
+bool try_get_pair(struct hwe_pair * pair)
+{
+	return kref_get_unless_zero(&pair->ref);
+}
+
+/*! Drops a reference to \a pair taken with get_pair(). */
+void put_pair(struct hwe_pair * pair)
+{
+	kref_put(&pair->ref, pair_release);
+}
+
+/*! Makes the response data of \a pair pending in \a resp,
+ * dropping the previously pending response, if any. */
+void hwe_resp_set(struct hwe_resp * resp, struct hwe_pair * pair, bool async)
+{
+	get_pair(pair);
+
+	if (resp->pair)
+		put_pair(resp->pair);
+
+	resp->pair = pair;
+	resp->pos = 0;
+	resp->async = async;
+}
+
+/*! Drops the pending response, if any. */
+void hwe_resp_clear(struct hwe_resp * resp)
+{
+	if (resp->pair)
+		put_pair(resp->pair);
+
+	resp->pair = NULL;
+	resp->pos = 0;
+	resp->async = false;
+}
+
+/*! Consumes up to \a size bytes of the pending response, leaving the
+ * copying to the caller, who may release the lock guarding \a resp
+ * first: the bytes are at \a *pos in the response of the returned
+ * pair, \a *len of them. The caller drops the reference to the pair
+ * with put_pair(). Returns NULL if no response is pending. */
+struct hwe_pair * hwe_resp_take(struct hwe_resp * resp, size_t size,
+	size_t * pos, size_t * len)
+{
+	struct hwe_pair * pair = resp->pair;
+	size_t sz = hwe_resp_pending(resp);
+
+	if (!sz)
+		return NULL;
+
+	if (sz > size)
+		sz = size;
+
+	get_pair(pair);
+	*pos = resp->pos;
+	*len = sz;
+
+	resp->pos += sz;
+
+	if (resp->pos == pair->resp_size)
+		hwe_resp_clear(resp);
+
+	return pair;
+}
+
 static void pair_delete(struct hwe_pair * pair)
 {
 #ifdef LOG_PAIRS
@@ -571,8 +761,12 @@ static void pair_delete(struct hwe_pair * pair)
 
 	sysfs_remove_file(pair->dev->pairs_kobj, &pair->pair_file.attr);
 
-	list_del(&pair->entry);
-	kfree(pair);
+	list_del_rcu(&pair->entry);
+
+	if (!find_pair_by_size(&pair->dev->pair_list, pair->req_size))
+		clear_bit(pair->req_size, pair->dev->req_sizes);
+
+	put_pair(pair);
 }
 
 static void clear_pairs(struct hwe_dev * dev)
@@ -590,13 +784,27 @@ struct hwe_pair * find_response(struct hwe_dev * dev,
 	return find_pair(&dev->pair_list, request, req_size);
 }
 
+/*! Tells quickly, without looking at the pairs, whether there may be
+ * a response to a request of \a size bytes. May be called without the
+ * device lock. */
+bool may_find_response(struct hwe_dev * dev, size_t size)
+{
+	return size <= HWE_MAX_REQUEST && test_bit(size, dev->req_sizes);
+}
+
+struct hwe_pair * find_response_prefix(struct hwe_dev * dev,
+	const unsigned char * data, size_t size)
+{
+	return find_pair_prefix(&dev->pair_list, data, size);
+}
+
 static void dev_release(struct kobject *kobj)
 {
 	struct hwe_dev * dev = to_dev(kobj);
 
 	pr_debug("%s: releasing device\n", kobject_name(kobj));
 
-	kfree(dev);
+	kfree_rcu(dev, rcu);
 
 	pr_debug("%s: device released\n", kobject_name(kobj));
 }
@@ -632,6 +840,23 @@ static ssize_t dev_count_show(struct hwe_dev * dev,
 	return ret;
 }
 
+/* The node through which userspace reaches the device: a file under
+ * /dev or, for the network interface, a network interface name. It is
+ * empty if there is none. */
+static ssize_t dev_node_show(struct hwe_dev * dev,
+	struct dev_attribute * attr, char * buf)
+{
+	ssize_t ret;
+
+	lock_devs(dev);
+
+	ret = dev_ops[dev->iface].node(dev->device, buf, PAGE_SIZE);
+
+	unlock_devs(dev);
+
+	return ret;
+}
+
 int hwe_get_pair_count(enum HWE_IFACE iface, long dev_index)
 {
 	int ret;
@@ -720,127 +945,163 @@ int hwe_get_pair(enum HWE_IFACE iface, long dev_index, long pair_index,
 	return ret;
 }
 
-static ssize_t dev_add_store(struct hwe_dev * dev,
-	struct dev_attribute * attr, const char * buf, size_t count)
+/*! Parses the pair in \a buf and checks it against the pairs of
+ * \a list, which cannot take any more pairs if \a full.
+ * Returns the new pair, or ERR_PTR() of -ENOMEM, -EINVAL (with the
+ * reason in \a err), -E2BIG or -EEXIST. */
+static struct hwe_pair * parse_pair(const char * buf, size_t count,
+	struct list_head * list, bool full, const char ** err)
 {
-	ssize_t ret = -EINVAL;
-	const char * dev_name = kobject_name(&dev->kobj);
-	const char * filename = attr->attr.name;
-	const char * err;
 	struct hwe_pair * pair;
-	struct hwe_pair * p;
-	long idx;
+	bool dup;
+	long ret = 0;
 
-	lock_devs(dev);
+	*err = NULL;
 
 	if (!(pair = kmalloc(sizeof(*pair), GFP_KERNEL)))
-		pr_err("%s/%s: out of memory!\n",
-			dev_name, filename);
+		return ERR_PTR(-ENOMEM);
+
+	if (!!(*err = str_to_pair(buf, count, pair)))
+		ret = -EINVAL;
 	else
-	if (!!(err = str_to_pair(buf, count, pair)))
+	if (full)
+		ret = -E2BIG;
+	else {
+		/* find_pair() walks the list as an RCU list */
+		rcu_read_lock();
+		dup = !!find_pair(list, pair->req, pair->req_size);
+		rcu_read_unlock();
+
+		if (dup)
+			ret = -EEXIST;
+		else
+			kref_init(&pair->ref);
+	}
+
+	if (ret) {
+		kfree(pair);
+		return ERR_PTR(ret);
+	}
+
+	return pair;
+}
+
+/* Logs an error of add_pair() or parse_pair(). */
+static void pr_pair_err(const char * dev_name, const char * filename,
+	long err, const char * reason)
+{
+	if (err == -EINVAL)
 		pr_err("%s/%s: invalid request-response string: %s\n",
-			dev_name, filename, err);
+			dev_name, filename, reason);
+	else
+	if (reason)
+		pr_err("%s/%s: %s\n",
+			dev_name, filename, reason);
+	else
+	if (err == -ENOMEM)
+		pr_err("%s/%s: out of memory!\n",
+			dev_name, filename);
 	else
-	if ((idx = find_first_zero_bit(dev->pairs_indexes, HWE_MAX_PAIRS))
-	     == HWE_MAX_PAIRS)
+	if (err == -E2BIG)
 		pr_err("%s/%s: too many request-response pairs\n",
 			dev_name, filename);
 	else
-	if (!!(p = find_pair(&dev->pair_list, pair->req, pair->req_size)))
-		pr_err("%s/%s: duplicate request-response pair (%ld)\n",
-			dev_name, filename, p->index);
-	else {
-		struct kobj_attribute * f;
+	if (err == -EEXIST)
+		pr_err("%s/%s: duplicate request-response pair\n",
+			dev_name, filename);
+}
 
-		pair->dev = dev;
-		pair->index = idx;
-		snprintf(pair->filename, sizeof(pair->filename),
-			"%ld", idx);
+/* Gives \a pair the index \a idx and its file. */
+static int create_pair_file(struct hwe_dev * dev, struct hwe_pair * pair,
+	long idx)
+{
+	struct kobj_attribute * f = &pair->pair_file;
+	int ret;
 
-		f = &pair->pair_file;
-		f->attr.name = pair->filename;
-		f->attr.mode = 0444;
-		f->show = pair_show;
+	pair->dev = dev;
+	pair->index = idx;
+	snprintf(pair->filename, sizeof(pair->filename), "%ld", idx);
 
-		ret = sysfs_create_file(dev->pairs_kobj, &f->attr);
+	f->attr.name = pair->filename;
+	f->attr.mode = 0444;
+	f->show = pair_show;
 
-		if (ret)
-			pr_err("%s/%s: sysfs_create_file() failed\n",
-				dev_name, filename);
-		else {
-#ifdef LOG_PAIRS
-			pr_debug("%s/%s: added pair %ld\n",
-				dev_name, filename, idx);
-#endif
-			set_bit(idx, dev->pairs_indexes);
-			list_add_tail(&pair->entry, &dev->pair_list);
-			ret = count;
-		}
-	}
+	ret = sysfs_create_file(dev->pairs_kobj, &f->attr);
+
+	if (!ret)
+		set_bit(idx, dev->pairs_indexes);
 
-	if (ret < 0)
+	return ret;
+}
+
+/* Adds the pair in \a buf to the pairs of \a dev.
+ * Returns the index of the pair, or a negative error code. */
+static long add_pair(struct hwe_dev * dev, const char * buf, size_t count,
+	const char ** err)
+{
+	struct hwe_pair * pair;
+	long idx;
+	int ret;
+
+	pair = parse_pair(buf, count, &dev->pair_list,
+		bitmap_full(dev->pairs_indexes, HWE_MAX_PAIRS), err);
+
+	if (IS_ERR(pair))
+		return PTR_ERR(pair);
+
+	idx = find_first_zero_bit(dev->pairs_indexes, HWE_MAX_PAIRS);
+
+	if (!!(ret = create_pair_file(dev, pair, idx))) {
+		*err = "sysfs_create_file() failed";
 		kfree(pair);
+		return ret;
+	}
+
+	set_bit(pair->req_size, dev->req_sizes);
+	list_add_tail_rcu(&pair->entry, &dev->pair_list);
+
+	return idx;
+}
+
+static ssize_t dev_add_store(struct hwe_dev * dev,
+	struct dev_attribute * attr, const char * buf, size_t count)
+{
+	const char * dev_name = kobject_name(&dev->kobj);
+	const char * filename = attr->attr.name;
+	const char * err;
+	long ret;
+
+	lock_devs(dev);
+
+	ret = add_pair(dev, buf, count, &err);
 
 	unlock_devs(dev);
 
-	return ret;
+	if (ret < 0) {
+		pr_pair_err(dev_name, filename, ret, err);
+		return ret;
+	}
+
+#ifdef LOG_PAIRS
+	pr_debug("%s/%s: added pair %ld\n", dev_name, filename, ret);
+#endif
+
+	return count;
 }
 
-/* FIXME This function is practically a duplicate of the above
- * dev_add_store. We need it to provide a similar IOCTL function.
- * It would be nice to somehow rewrite them both to eliminate
- * this duplicate code. */
+/*! The IOCTL counterpart of dev_add_store(). */
 long hwe_add_pair(enum HWE_IFACE iface, long dev_index, const char * pair_str)
 {
-	long ret = -EINVAL;
+	long ret;
 	const char * err;
-	struct hwe_pair * pair;
-	struct hwe_pair * p;
-	long idx;
 	struct hwe_dev * dev;
 
 	lock_iface_devs(iface);
 
 	if (!(dev = find_device_by_index(iface, dev_index)))
 		ret = -ENODEV;
-	if (!(pair = kmalloc(sizeof(*pair), GFP_KERNEL)))
-		ret = -ENOMEM;
 	else
-	if (!!(err = str_to_pair(pair_str, strlen(pair_str), pair)))
-		ret = -EINVAL;
-	else
-	if ((idx = find_first_zero_bit(dev->pairs_indexes, HWE_MAX_PAIRS))
-	     == HWE_MAX_PAIRS)
-		ret = -E2BIG;
-	else
-	if (!!(p = find_pair(&dev->pair_list, pair->req, pair->req_size)))
-		ret = -EEXIST;
-	else {
-		struct kobj_attribute * f;
-
-		pair->dev = dev;
-		pair->index = idx;
-		snprintf(pair->filename, sizeof(pair->filename),
-			"%ld", idx);
-
-		f = &pair->pair_file;
-		f->attr.name = pair->filename;
-		f->attr.mode = 0444;
-		f->show = pair_show;
-
-		ret = sysfs_create_file(dev->pairs_kobj, &f->attr);
-
-		if (ret)
-			/* error */;
-		else {
-			set_bit(idx, dev->pairs_indexes);
-			list_add_tail(&pair->entry, &dev->pair_list);
-			ret = idx;
-		}
-	}
-
-	if (ret < 0)
-		kfree(pair);
+		ret = add_pair(dev, pair_str, strlen(pair_str), &err);
 
 	unlock_iface_devs(iface);
 
@@ -936,10 +1197,188 @@ int hwe_clear_pairs(enum HWE_IFACE iface, long dev_index)
 	return ret;
 }
 
+/* Pairs are staged by writing them to the `stage` file, just as to the
+ * `add` file. Writing 1 to the `commit` file then replaces all the
+ * pairs of the device with the staged ones, and writing 0 drops the
+ * staged pairs. The staged pairs have no index and no file until they
+ * are committed. */
+static ssize_t dev_stage_store(struct hwe_dev * dev,
+	struct dev_attribute * attr, const char * buf, size_t count)
+{
+	const char * err;
+	struct hwe_pair * pair;
+
+	lock_devs(dev);
+
+	pair = parse_pair(buf, count, &dev->stage_list,
+		dev->stage_count == HWE_MAX_PAIRS, &err);
+
+	if (!IS_ERR(pair)) {
+		pair->dev = dev;
+		pair->index = -1;
+		list_add_tail(&pair->entry, &dev->stage_list);
+		dev->stage_count++;
+	}
+
+	unlock_devs(dev);
+
+	if (IS_ERR(pair)) {
+		pr_pair_err(kobject_name(&dev->kobj), attr->attr.name,
+			PTR_ERR(pair), err);
+		return PTR_ERR(pair);
+	}
+
+	return count;
+}
+
+static void clear_stage(struct hwe_dev * dev)
+{
+	struct hwe_pair * pair;
+	struct hwe_pair * tmp;
+
+	list_for_each_entry_safe (pair, tmp, &dev->stage_list, entry) {
+		list_del(&pair->entry);
+		put_pair(pair);
+	}
+
+	dev->stage_count = 0;
+}
+
+/* Makes the staged pairs of \a dev its pair list and drops the old
+ * pairs. The lockless readers of the pair list (see find_response())
+ * see either all the old pairs or all the new ones: the new list is
+ * published with a single pointer, and it ends at the list head, just
+ * like the old one, so that the readers still on the old list leave it
+ * as usual. The old pairs are therefore left linked to each other;
+ * pair_release() frees them only after the readers are gone. */
+static void swap_pairs(struct hwe_dev * dev)
+{
+	struct list_head * live = &dev->pair_list;
+	struct list_head * first = dev->stage_list.next;
+	struct list_head * last = dev->stage_list.prev;
+	struct list_head * old_first = live->next;
+	struct list_head * e;
+	struct list_head * next;
+
+	if (list_empty(&dev->stage_list))
+		first = last = live;
+	else {
+		first->prev = live;
+		last->next = live;
+	}
+
+	live->prev = last;
+	rcu_assign_pointer(list_next_rcu(live), first);
+
+	INIT_LIST_HEAD(&dev->stage_list);
+	dev->stage_count = 0;
+
+	for (e = old_first; e != live; e = next) {
+		struct hwe_pair * pair = list_entry(e, struct hwe_pair, entry);
+
+		next = e->next;
+
+		clear_bit(pair->index, dev->pairs_indexes);
+
+		sysfs_remove_file(dev->pairs_kobj, &pair->pair_file.attr);
+
+		if (!find_pair_by_size(live, pair->req_size))
+			clear_bit(pair->req_size, dev->req_sizes);
+
+		put_pair(pair);
+	}
+}
+
+/* Replaces the pairs of \a dev with the staged ones. */
+static void commit_pairs(struct hwe_dev * dev)
+{
+	struct hwe_pair * pair;
+	long idx = 0;
+
+	/* the new sizes must be there before the new pairs are */
+	list_for_each_entry (pair, &dev->stage_list, entry)
+		set_bit(pair->req_size, dev->req_sizes);
+
+	/* this also clears the sizes only the old pairs had */
+	swap_pairs(dev);
+
+	list_for_each_entry (pair, &dev->pair_list, entry)
+		if (create_pair_file(dev, pair, idx++))
+			pr_err("%s: sysfs_create_file() failed\n",
+				kobject_name(&dev->kobj));
+}
+
+static ssize_t dev_commit_store(struct hwe_dev * dev,
+	struct dev_attribute * attr, const char * buf, size_t count)
+{
+	bool val;
+
+	if (kstrtobool(buf, &val))
+		return -EINVAL;
+
+	lock_devs(dev);
+
+	if (val)
+		commit_pairs(dev);
+	else
+		clear_stage(dev);
+
+	unlock_devs(dev);
+
+	return count;
+}
+
+/* The label is up to userspace, e.g. the name of the section of the
+ * device in a configuration file; the control utility finds the
+ * devices of a loaded configuration by their labels. */
+static ssize_t dev_label_show(struct hwe_dev * dev,
+	struct dev_attribute * attr, char * buf)
+{
+	ssize_t ret;
+
+	lock_devs(dev);
+
+	ret = sprintf(buf, "%s", dev->label);
+
+	unlock_devs(dev);
+
+	return ret;
+}
+
+static ssize_t dev_label_store(struct hwe_dev * dev,
+	struct dev_attribute * attr, const char * buf, size_t count)
+{
+	char label[HWE_MAX_LABEL + 1];
+	size_t len;
+
+	buf = skip_spaces(buf);
+
+	for (len = strlen(buf); len && isspace((unsigned char)buf[len - 1]); len--)
+		;
+
+	if (len > HWE_MAX_LABEL)
+		return -EINVAL;
+
+	memcpy(label, buf, len);
+	label[len] = 0;
+
+	lock_devs(dev);
+
+	strcpy(dev->label, label);
+
+	unlock_devs(dev);
+
+	return count;
+}
+
 /* All attributes (files in a sysfs directory) for the device.
  * If you want to add/remove a device attribute, you should start here. */
 #define FOREACH_DEV_ATTR(A)\
 	A(count, RO)	\
+	A(node, RO)	\
+	A(label, RW)	\
+	A(stage, WO)	\
+	A(commit, WO)	\
 	A(add, WO)	\
 	A(delete, WO)	\
 	A(clear, WO)	\
@@ -977,7 +1416,7 @@ static int init_iface(enum HWE_IFACE iface)
 
 	INIT_LIST_HEAD(&ifc->dev_list);
 
-	bitmap_zero(ifc->dev_indexes, HWE_MAX_DEVICES);
+	bitmap_zero(ifc->dev_indexes, HWE_MAX_NET_DEVICES);
 
 	sema_init(&ifc->sem, 1);
 
@@ -14,6 +14,7 @@
 #include <linux/serial.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
+#include <linux/rcupdate.h>
 
 #include "hwemu.h"
 
@@ -98,7 +99,11 @@ static int hwetty_write(struct tty_struct *tty,
 	if (!dev)
 		goto quit;
 
+	/* The pair list is an RCU list; the interface lock keeps the
+	 * pair found from being deleted. */
+	rcu_read_lock();
 	pair = find_response(dev->hwedev, buffer, count);
+	rcu_read_unlock();
 
 	if (pair) {
 		int n = tty_insert_flip_string_fixed_flag(&ports[dev->index],
@@ -156,12 +161,22 @@ static const struct tty_operations serial_ops = {
 	.write_room = hwetty_write_room,
 };
 
+/*! TTY devices have no settings of their own. */
+const struct attribute_group * hwe_tty_dev_groups[] = {
+	NULL
+};
+
 /*! Create an instance of the TTY device.
  */
-struct hwe_dev_priv * hwe_create_tty_device(struct hwe_dev * hwedev, long index)
+struct hwe_dev_priv * hwe_create_tty_device(struct hwe_dev * hwedev, long index,
+	const char * options)
 {
 	struct hwe_dev_priv * dev = NULL;
 
+	if (*options)
+		pr_err("%s%ld: device not created; unsupported options: %s\n",
+			iface_to_str(HWE_TTY), index, options);
+	else
 	if (index < 0 || index >= HWE_MAX_DEVICES)
 		/* can't happen? */
 		pr_err("%s%ld: device not created; index out of range!\n",
@@ -205,6 +220,13 @@ void hwe_destroy_tty_device(struct hwe_dev_priv * device)
 	devices[idx] = NULL;
 }
 
+/*! Write the name of the node of the TTY device, e.g. ttyHWE0.
+ */
+int hwe_tty_device_node(struct hwe_dev_priv * device, char * buf, size_t size)
+{
+	return snprintf(buf, size, "%s%d", driver->name, device->index);
+}
+
 /*! Initialize the TTY emulator.
  */
 int hwe_init_tty(void)
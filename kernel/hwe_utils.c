@@ -7,6 +7,7 @@
 #	include <linux/kobject.h>
 #	include <linux/kernel.h>
 #	include <linux/list.h>
+#	include <linux/rculist.h>
 #	include <linux/string.h>
 #	include <linux/ctype.h>
 #	include <linux/jiffies.h>
@@ -160,6 +161,40 @@ static inline char * hwe_time_to_str(char * str, size_t size, unsigned t)
 	return str + n;
 }
 
+/*! Splits the next option off \a str, a list of options separated by
+    blanks, each of the form `name[=value]`. Returns a pointer past the
+    option, or NULL if there are no more options. The name and the
+    value (empty if there is none) are truncated to fit \a name_size
+    and \a value_size bytes. */
+const char * hwe_next_option(const char * str, char * name, size_t name_size,
+	char * value, size_t value_size)
+{
+	size_t n;
+
+	while (*str && isspace((unsigned char)*str))
+		str++;
+
+	if (!*str)
+		return NULL;
+
+	for (n = 0; *str && *str != '=' && !isspace((unsigned char)*str); str++)
+		if (n + 1 < name_size)
+			name[n++] = *str;
+
+	name[n] = 0;
+
+	n = 0;
+
+	if (*str == '=')
+		for (str++; *str && !isspace((unsigned char)*str); str++)
+			if (n + 1 < value_size)
+				value[n++] = *str;
+
+	value[n] = 0;
+
+	return str;
+}
+
 /*! Key-value string parser
  */
 const char * str_to_pair(const char * str, size_t str_size, struct hwe_pair * pair)
@@ -237,6 +272,8 @@ const char * str_to_pair(const char * str, size_t str_size, struct hwe_pair * pa
 		return "invalid character in response string";
 
 	pair->resp_size = sz / 2;
+	pair->echo = !pair->async_rx && pair->resp_size == pair->req_size &&
+		!memcmp(pair->resp, pair->req, pair->req_size);
 
 	return NULL;
 }
@@ -276,7 +313,8 @@ struct hwe_pair * find_pair(struct list_head * list, const unsigned char * reque
 {
 	struct hwe_pair * ret;
 
-	list_for_each_entry (ret, list, entry) {
+	/* under rcu_read_lock(), even when the device lock is held */
+	list_for_each_entry_rcu (ret, list, entry) {
 		/* XXX skip the pairs used in asynchronous data exchange */
 		if (!ret->async_rx && ret->req_size == req_size &&
 		    memcmp(ret->req, request, req_size) == 0)
@@ -286,6 +324,55 @@ struct hwe_pair * find_pair(struct list_head * list, const unsigned char * reque
 	return NULL;
 }
 
+/*! Returns a pair with a request of \a req_size bytes, if any. */
+struct hwe_pair * find_pair_by_size(struct list_head * list, size_t req_size)
+{
+	struct hwe_pair * ret;
+
+	list_for_each_entry (ret, list, entry) {
+		if (!ret->async_rx && ret->req_size == req_size)
+			return ret;
+	}
+
+	return NULL;
+}
+
+/*! Same as find_pair(), for requests which are not in a contiguous
+    buffer: \a equal compares the request of a pair with them. */
+struct hwe_pair * find_pair_cb(struct list_head * list, size_t req_size,
+	bool (*equal)(const unsigned char * req, size_t size, void * arg), void * arg)
+{
+	struct hwe_pair * ret;
+
+	list_for_each_entry_rcu (ret, list, entry) {
+		/* XXX skip the pairs used in asynchronous data exchange */
+		if (!ret->async_rx && ret->req_size == req_size &&
+		    equal(ret->req, req_size, arg))
+			return ret;
+	}
+
+	return NULL;
+}
+
+/*! Returns the pair with the shortest request that is a prefix
+    of \a data, if any. */
+struct hwe_pair * find_pair_prefix(struct list_head * list, const unsigned char * data, size_t size)
+{
+	struct hwe_pair * p;
+	struct hwe_pair * ret = NULL;
+
+	/* under rcu_read_lock(), even when the device lock is held */
+	list_for_each_entry_rcu (p, list, entry) {
+		/* XXX skip the pairs used in asynchronous data exchange */
+		if (!p->async_rx && p->req_size <= size &&
+		    (!ret || p->req_size < ret->req_size) &&
+		    memcmp(p->req, data, p->req_size) == 0)
+			ret = p;
+	}
+
+	return ret;
+}
+
 struct hwe_pair * get_pair_at_index(struct list_head * list, size_t index)
 {
 	struct hwe_pair * ret;
@@ -26,12 +26,75 @@ struct hwe_dev;
 /*! Device implementation for particular interfaces. */
 struct hwe_dev_priv;
 
+/*! \brief `sysfs` attribute of a device */
+struct dev_attribute {
+	struct attribute attr;
+	ssize_t (*show)(struct hwe_dev * dev,
+		struct dev_attribute * attr, char * buf);
+	ssize_t (*store)(struct hwe_dev * dev,
+		struct dev_attribute * attr, const char * buf, size_t count);
+};
+
+/*! Defines a read-write device attribute handled by
+ * \a __name ## _show() and \a __name ## _store(). Interfaces use
+ * this for their own device settings (see hwe_*_dev_groups). */
+#define HWE_DEV_ATTR_RW(__name) \
+static struct dev_attribute hwe_attr_##__name = \
+	__ATTR(__name, 0664, __name##_show, __name##_store)
+
+/*! Defines a read-only device attribute handled by
+ * \a __name ## _show(). */
+#define HWE_DEV_ATTR_RO(__name) \
+static struct dev_attribute hwe_attr_##__name = \
+	__ATTR(__name, 0444, __name##_show, NULL)
+
+/*! Defines a read-write device attribute for the setting \a __name,
+ * which is a field of struct hwe_dev_priv, in range \a __min..\a __max. */
+#define HWE_DEV_ATTR_UINT_RANGE(__name, __min, __max) \
+static ssize_t __name##_show(struct hwe_dev * dev, \
+	struct dev_attribute * attr, char * buf) \
+{ \
+	ssize_t ret; \
+\
+	lock_devs(dev); \
+	ret = sprintf(buf, "%u", (unsigned)hwe_get_dev_priv(dev)->__name); \
+	unlock_devs(dev); \
+\
+	return ret; \
+} \
+\
+static ssize_t __name##_store(struct hwe_dev * dev, \
+	struct dev_attribute * attr, const char * buf, size_t count) \
+{ \
+	unsigned val; \
+\
+	if (kstrtouint(buf, 0, &val) || val < (__min) || val > (__max)) \
+		return -EINVAL; \
+\
+	lock_devs(dev); \
+	/* may be read without the lock, e.g. by a transfer */ \
+	WRITE_ONCE(hwe_get_dev_priv(dev)->__name, val); \
+	unlock_devs(dev); \
+\
+	return count; \
+} \
+\
+HWE_DEV_ATTR_RW(__name)
+
+/*! Same as HWE_DEV_ATTR_UINT_RANGE() in range 0..\a __max */
+#define HWE_DEV_ATTR_UINT(__name, __max) \
+	HWE_DEV_ATTR_UINT_RANGE(__name, 0, __max)
+
 #define HWE_STR(x) #x
 #define HWE_STRLEN(x) (sizeof(HWE_STR(x)) - 1)
 
 /*! \brief Request-response pair */
 struct hwe_pair {
 	struct list_head entry;
+	/* the pair is freed when the last reference is dropped;
+	 * see get_pair() and put_pair() */
+	struct kref ref;
+	struct rcu_head rcu;
 	unsigned char req[HWE_MAX_REQUEST];
 	size_t req_size;
 	unsigned char resp[HWE_MAX_RESPONSE];
@@ -42,6 +105,8 @@ struct hwe_pair {
 	 * in range 0..HWE_MAX_PAIRS */
 	char filename[HWE_STRLEN(HWE_MAX_PAIRS) + 1];
 	struct kobj_attribute pair_file;
+	/* the response is the same as the request */
+	bool echo;
 	/* the following fields are used in asynchronous data exchange */
 	bool async_rx;
 	unsigned long period_ms;
@@ -49,6 +114,24 @@ struct hwe_pair {
 	unsigned long time;
 };
 
+/*! \brief Pending response
+ *
+ * Refers to the response data of a pair, which never changes once the
+ * pair has been added, so that the data is copied only once, straight
+ * into the reader's buffer.
+ */
+struct hwe_resp {
+	struct hwe_pair * pair;
+	size_t pos;
+	bool async;
+};
+
+/*! Returns the number of bytes of the pending response not read yet */
+static inline size_t hwe_resp_pending(const struct hwe_resp * resp)
+{
+	return resp->pair ? resp->pair->resp_size - resp->pos : 0;
+}
+
 /*! Returns the number of entries in a list */
 static inline size_t list_entry_count(struct list_head * list)
 {
@@ -66,15 +149,25 @@ const char * iface_to_str(enum HWE_IFACE iface);
 int str_to_iface(const char * str, enum HWE_IFACE * iface);
 const char * str_to_pair(const char * str, size_t str_size, struct hwe_pair * pair);
 const char * pair_to_str(struct hwe_pair * pair);
+const char * hwe_next_option(const char * str, char * name, size_t name_size,
+	char * value, size_t value_size);
 struct hwe_pair * find_pair(struct list_head * list, const unsigned char * request, size_t req_size);
+struct hwe_pair * find_pair_prefix(struct list_head * list, const unsigned char * data, size_t size);
+struct hwe_pair * find_pair_by_size(struct list_head * list, size_t req_size);
+struct hwe_pair * find_pair_cb(struct list_head * list, size_t req_size,
+	bool (*equal)(const unsigned char * req, size_t size, void * arg), void * arg);
 struct hwe_pair * get_pair_at_index(struct list_head * list, size_t index);
 
 /* in hwe_sysfs.c */
 struct hwe_dev_priv * hwe_get_dev_priv(struct hwe_dev * dev);
+struct hwe_dev * hwe_kobj_to_dev(struct kobject * kobj);
 enum HWE_IFACE hwe_get_dev_iface(struct hwe_dev * dev);
 long hwe_get_dev_index(struct hwe_dev * dev);
 struct hwe_pair * find_response(struct hwe_dev * dev,
 	const unsigned char * request, int req_size);
+bool may_find_response(struct hwe_dev * dev, size_t size);
+struct hwe_pair * find_response_prefix(struct hwe_dev * dev,
+	const unsigned char * data, size_t size);
 void lock_devs(struct hwe_dev * dev);
 void unlock_devs(struct hwe_dev * dev);
 void lock_iface_devs(enum HWE_IFACE iface);
@@ -83,6 +176,16 @@ bool try_lock_iface_devs(enum HWE_IFACE iface);
 struct hwe_dev * find_first_device(enum HWE_IFACE iface);
 struct hwe_dev * find_next_device(enum HWE_IFACE iface, struct hwe_dev * device);
 struct list_head * get_pair_list(struct hwe_dev * dev);
+void get_pair(struct hwe_pair * pair);
+bool try_get_pair(struct hwe_pair * pair);
+void put_pair(struct hwe_pair * pair);
+void hwe_resp_set(struct hwe_resp * resp, struct hwe_pair * pair, bool async);
+void hwe_resp_clear(struct hwe_resp * resp);
+struct hwe_pair * hwe_resp_take(struct hwe_resp * resp, size_t size,
+	size_t * pos, size_t * len);
+
+/* in hwe_async.c */
+void hwe_delay_ns(u64 ns);
 
 /* in hwe_main.c */
 void hwe_log_request(enum HWE_IFACE iface, long dev_num,
@@ -13,6 +13,7 @@ import sys
 import random
 import subprocess
 import re
+import zlib
 
 IF_I2C = 'i2c'
 IF_TTY = 'tty'
@@ -25,6 +26,9 @@ EXTERN_DEV_NAME_PREFIXES = { IF_I2C: 'i2c-', IF_TTY: 'ttyUSB', IF_NET: 'eth', IF
 
 KMOD_NAME = 'hwemu'
 
+# Kernel module parameters that can be set in configuration files
+KMOD_PARAMS = ('log_requests', 'log_responses', 'spi_chipselects')
+
 SYSFS_BASE_DIR = '/sys/kernel/' + KMOD_NAME
 
 # Maximum length of a request
@@ -42,6 +46,18 @@ HWE_MAX_PAIRS = 1000
 # Maximum number of devices per interface
 HWE_MAX_DEVICES = 256
 
+# Maximum length of a network device name, including the terminating zero
+IFNAMSIZ = 16
+
+# Maximum number of net devices (network devices and their endpoints)
+HWE_MAX_NET_DEVICES = 4096
+
+# Maximum number of i2c devices (adapters and their clients)
+HWE_MAX_I2C_DEVICES = 1024
+
+# Prefix of the keys that set device options rather than define pairs
+OPTION_PREFIX = 'option:'
+
 # ----------------------------------------------------------------------
 
 def throw(msg):
@@ -92,6 +108,12 @@ def check_async_key(string):
 
 # ----------------------------------------------------------------------
 
+def is_option_name(name):
+    # option names are the names of the device attribute files in sysfs
+    return re.fullmatch(r'[a-z][a-z0-9_]*', name) is not None
+
+# ----------------------------------------------------------------------
+
 def is_async_pair(pair):
     p = pair.split('=')
     if len(p) != 2:
@@ -147,6 +169,8 @@ def traverse_config(config, *, on_iface, on_dev, on_pair):
         on_pair = lambda iface_name, dev_name, pair_num, pair: None
 
     for iface_name, devs in config.items():
+        if iface_name.startswith('_'):
+            continue
 
         ret = on_iface(iface_name)
         if ret is not None:
@@ -230,7 +254,8 @@ def config_to_pretty_str(config):
     def on_dev(iface_name, dev_name):
         nonlocal ret
         ret += '    %s:\n' % (dev_name)
-        ret += '      %d pair(s)\n' % (len(config[iface_name][dev_name]))
+        ret += '      %d pair(s)\n' % (sum(isinstance(i, int)
+            for i in config[iface_name][dev_name]))
 
     traverse_config(config, on_iface = on_iface, on_dev = on_dev, on_pair = None)
 
@@ -263,6 +288,20 @@ def get_file_names(path):
 
 # ----------------------------------------------------------------------
 
+def dev_label(d):
+    '''
+    Return the label of device d in sysfs: the name of its section and,
+    if it has options, a digest of them, so that reload_config() does
+    not keep a device whose options have changed.
+    '''
+    opts = d.get('_options', {})
+    if not opts:
+        return d['_extern_dev_name']
+    s = ' '.join('%s=%s' % (k, opts[k]) for k in sorted(opts))
+    return '%s %08x' % (d['_extern_dev_name'], zlib.crc32(s.encode()))
+
+# ----------------------------------------------------------------------
+
 def write_config(config):
     '''
     Write config to sysfs
@@ -271,21 +310,189 @@ def write_config(config):
         1. arrays of devices and pairs have no gaps;
         2. no config is currently loaded in sysfs.
 
+    The interfaces are set up in parallel. The devices of an interface
+    are created in batches of devices with the same options, so that
+    each batch is a single write (see iface_add_store() in the kernel
+    module).
     '''
+    from concurrent.futures import ThreadPoolExecutor
+
     path = SYSFS_BASE_DIR
 
     def on_dev(iface_name, dev_name):
         nonlocal path
-        f = '%s/%s/add' % (path, iface_name)
-        write_file(f, '1')
+        if config[iface_name][dev_name].get('_extern_dev_name') is not None:
+            write_file('%s/%s/%s/label' % (path, iface_name, dev_name),
+                dev_label(config[iface_name][dev_name]))
+
+        for name, val in config[iface_name][dev_name].get('_options', {}).items():
+            f = '%s/%s/%s/%s' % (path, iface_name, dev_name, name)
+            if not os.path.isfile(f):
+                throw('Device %s has no option %s' % (dev_name, name))
+            write_file(f, val)
 
     def on_pair(iface_name, dev_name, pair_num, pair):
         nonlocal path
         f = '%s/%s/%s/add' % (path, iface_name, dev_name)
         write_file(f, pair)
 
-    return traverse_config(config, on_iface = None, on_dev = on_dev,\
-        on_pair = on_pair) is None
+    def write_iface(iface_name):
+        devs = config[iface_name]
+        opts = [devs[d].get('_add_options', '') for d in
+            sorted((d for d in devs if not d.startswith('_')),
+                key = lambda d: int(d[len(iface_name):]))]
+
+        # the devices get the lowest free indexes, i.e. those of
+        # their names
+        i = 0
+        while i < len(opts):
+            n = 1
+            while i + n < len(opts) and opts[i + n] == opts[i]:
+                n += 1
+            write_file('%s/%s/add' % (path, iface_name),
+                ('%d %s' % (n, opts[i])).rstrip())
+            i += n
+
+        return traverse_config({ iface_name: devs }, on_iface = None,
+            on_dev = on_dev, on_pair = on_pair) is None
+
+    iface_names = [i for i in config if not i.startswith('_')]
+
+    if not iface_names:
+        return True
+
+    with ThreadPoolExecutor(max_workers = len(iface_names)) as ex:
+        results = [ex.submit(write_iface, i) for i in iface_names]
+        # raises the exception of an interface, if any
+        return all([r.result() for r in results])
+
+# ----------------------------------------------------------------------
+
+def reload_config(config):
+    '''
+    Bring the loaded config in line with config without reloading the
+    kernel module
+
+    The devices are matched by their labels, i.e. the names of their
+    sections and a digest of their options (see dev_label()). A device
+    whose section is gone, whose options have changed or whose parent
+    is not kept, is removed along with its symlink; the other devices
+    are kept, and all their pairs are replaced at once (see
+    commit_pairs() in the kernel module). The devices of new sections,
+    and those whose options have changed, are created.
+
+    The pairs of the devices kept are staged before anything is
+    changed, so that a bad pair leaves the loaded config as it is.
+
+    Return the part of config with the devices created, named as in
+    sysfs, for ifaces_init().
+    '''
+    path = SYSFS_BASE_DIR
+
+    live = {}
+    for ifc in IFACES:
+        for dev_name in get_dir_names('%s/%s' % (path, ifc)):
+            label = read_file('%s/%s/%s/label' % (path, ifc, dev_name)).rstrip()
+            if label != '':
+                live[(ifc, label)] = dev_name
+
+    # the names in sysfs of the devices of config
+    names = {}
+    kept = set()
+
+    def on_dev(iface_name, dev_name):
+        d = config[iface_name][dev_name]
+        name = live.get((iface_name, dev_label(d)))
+        parent = d.get('_parent')
+        if name is not None and (parent is None or (iface_name, parent) in kept):
+            names[(iface_name, dev_name)] = name
+            kept.add((iface_name, dev_name))
+
+    traverse_config(config, on_iface = None, on_dev = on_dev, on_pair = None)
+
+    def kept_path(ifc, dev_name):
+        return '%s/%s/%s' % (path, ifc, names[(ifc, dev_name)])
+
+    # stage the pairs of the devices kept
+
+    try:
+        for ifc, dev_name in sorted(kept):
+            d = config[ifc][dev_name]
+            dev_path = kept_path(ifc, dev_name)
+
+            # drop what a failed reload may have left staged
+            write_file(dev_path + '/commit', '0')
+
+            for pair_num in sorted(i for i in d.keys() if isinstance(i, int)):
+                write_file(dev_path + '/stage', d[pair_num])
+    except:
+        for ifc, dev_name in kept:
+            try: write_file(kept_path(ifc, dev_name) + '/commit', '0')
+            except: pass
+        raise
+
+    # remove the devices not kept
+
+    kept_names = set((ifc, names[(ifc, d)]) for ifc, d in kept)
+
+    for (ifc, label), dev_name in live.items():
+        if (ifc, dev_name) in kept_names:
+            continue
+        lnk = '/dev/' + label.split(' ')[0]
+        if ifc != IF_NET and os.path.islink(lnk):
+            os.remove(lnk)
+        write_file('%s/%s/uninstall' % (path, ifc), dev_name)
+
+    # replace the pairs of the devices kept
+
+    for ifc, dev_name in sorted(kept):
+        write_file(kept_path(ifc, dev_name) + '/commit', '1')
+
+    # create the new devices; each one is the entry that appears in
+    # sysfs when it is added, whatever index the module gives it (the
+    # options, e.g. the parent of a client, can't be passed through
+    # HWEIOCTL_ADD_DEVICE_EX)
+
+    created = {}
+
+    def on_new_dev(iface_name, dev_name):
+        if (iface_name, dev_name) in kept:
+            return
+
+        d = dict(config[iface_name][dev_name])
+
+        opts = d.get('_add_options', '1')
+        if d.get('_parent') is not None:
+            d['_parent'] = names[(iface_name, d['_parent'])]
+            opts = re.sub(r'^parent=\S+', 'parent=' + d['_parent'], opts)
+            d['_add_options'] = opts
+
+        iface_path = '%s/%s' % (path, iface_name)
+        before = set(get_dir_names(iface_path))
+        write_file(iface_path + '/add', opts)
+        new = set(get_dir_names(iface_path)) - before
+        if len(new) != 1:
+            throw('Device %s: %d devices appeared in %s instead of one' % \
+                (dev_name, len(new), iface_path))
+        name = new.pop()
+
+        names[(iface_name, dev_name)] = name
+        created.setdefault(iface_name, {})[name] = d
+
+        dev_path = '%s/%s/%s' % (path, iface_name, name)
+        write_file(dev_path + '/label', dev_label(d))
+
+        for opt, val in d.get('_options', {}).items():
+            if not os.path.isfile(dev_path + '/' + opt):
+                throw('Device %s has no option %s' % (dev_name, opt))
+            write_file(dev_path + '/' + opt, val)
+
+        for pair_num in sorted(i for i in d.keys() if isinstance(i, int)):
+            write_file(dev_path + '/add', d[pair_num])
+
+    traverse_config(config, on_iface = None, on_dev = on_new_dev, on_pair = None)
+
+    return created
 
 # ----------------------------------------------------------------------
 
@@ -349,33 +556,16 @@ def i2c_get_adapter_name(dev_name):
 
 # ----------------------------------------------------------------------
 
-def is_i2c_dev_loaded():
-    return os.path.isdir(I2C_DEV_DIR)
-
-# ----------------------------------------------------------------------
-
-SPIDEV_DIR = '/sys/class/spidev'
-
-# ----------------------------------------------------------------------
-
-def is_spidev_loaded():
-    return os.path.isdir(SPIDEV_DIR)
-
-# ----------------------------------------------------------------------
-
-def _spidev_absnum(devname):
-    if not devname.startswith('spidev'):
-        return -1
-    lst = devname[len('spidev'):].split('.')
-    if len(lst) != 2 or not lst[0].isdigit() or not lst[1].isdigit():
-        return -1
-    return int(lst[0]) * 10000 + int(lst[1])
+def get_dev_node(iface_name, dev_name):
+    '''
+    Return the name of the node of a device under /dev, or of its network
+    interface, as the kernel module reports it.
+    '''
+    return read_file('%s/%s/%s/node' % (SYSFS_BASE_DIR, iface_name, dev_name)).rstrip()
 
 # ----------------------------------------------------------------------
 
 HWEMU_TTY_NAME = '/dev/ttyHWE'
-HWEMU_NETDEV_NAME = 'hwenet'
-
 def ifaces_init(config):
 
     symlinks = {}
@@ -388,99 +578,23 @@ def ifaces_init(config):
         if lnk is None:
             throw('Broken config: No name for device %s' % (dev_name))
 
+        if config[iface_name][dev_name].get('_parent') is not None:
+            # network endpoints and i2c clients have no device
+            # of their own
+            return
+
         if iface_name == IF_NET:
             netdevs.append(lnk)
         else:
+            # The kernel module loads i2c-dev and binds spidev to
+            # its devices, so their nodes exist by now.
+            node = get_dev_node(iface_name, dev_name)
             symlinks[dev_name] = { 'link': '/dev/' + lnk }
+            if node and os.path.exists('/dev/' + node):
+                symlinks[dev_name]['target'] = '/dev/' + node
 
     traverse_config(config, on_iface = None, on_dev = on_dev, on_pair = None)
 
-    # i2c
-
-    ifc = IF_I2C
-
-    # We cannot access i2c devices from userspace without the i2c-dev
-    # driver loaded.
-
-    if not is_i2c_dev_loaded():
-        run(['modprobe', 'i2c_dev'])
-
-    sstr = 'adapter '
-
-    # Collect our /dev/i2c* device names from /sys/class/i2c-dev
-
-    with os.scandir(I2C_DEV_DIR) as it:
-        for e in it:
-            if e.is_dir():
-                fstr = i2c_get_adapter_name(e.name)
-                if KMOD_NAME in fstr:
-                    n = fstr.find(sstr)
-                    if n >= 0:
-                        dev_num = fstr[n + len(sstr):].rstrip()
-                        dev_name = ifc + dev_num
-                        if dev_name in symlinks:
-                            symlinks[dev_name]['target'] = '/dev/' + e.name
-                        #else:
-                        #    throw('Unexpected device /dev/%s' % (e.name))
-
-    # spi
-
-    ifc = IF_SPI
-
-    # We cannot access spi devices from userspace without the spidev
-    # driver loaded.
-
-    if not is_spidev_loaded():
-        run(['modprobe', 'spidev'])
-
-    # bind the spidev driver to our devices
-
-    with os.scandir('/sys/bus/spi/devices') as it:
-        for e in it:
-            if e.is_symlink() and '/hwe_plat/' in os.path.realpath(e.path):
-                ovrr_file = '/sys/bus/spi/devices/%s/driver_override' % e.name
-                if not os.path.isfile(ovrr_file):
-                    throw('We can\'t create emulated SPI devices since your kernel '+
-                        'doesn\'t support SPI driver overriding. Please upgrade '+
-                        'to kernel version 4.20 or later.')
-                write_file(ovrr_file, 'spidev')
-                write_file('/sys/bus/spi/drivers/spidev/bind', e.name)
-
-    # collect the symlinks
-
-    spidevs = []
-
-    with os.scandir(SPIDEV_DIR) as it:
-        for e in it:
-            if e.is_symlink():
-                tgt = os.path.realpath(e.path)
-                if '/hwe_plat/' in tgt:
-                    if _spidev_absnum(e.name) >= 0: # sanity
-                        spidevs.append(e.name)
-
-    spidevs.sort(key = _spidev_absnum)
-
-    for i in range(len(spidevs)):
-        dev_name = IF_SPI + str(i)
-        if dev_name in symlinks:
-            symlinks[dev_name]['target'] = '/dev/' + spidevs[i]
-        #else:
-        #    throw('Unexpected device /dev/%s' % (spidevs[i]))
-
-    # tty
-
-    import glob
-
-    ifc = IF_TTY
-
-    for df in sorted(glob.glob(HWEMU_TTY_NAME + '*'), key = lambda d: int(d[len(HWEMU_TTY_NAME):])):
-        dev_num = df[len(HWEMU_TTY_NAME):]
-        dev_name = ifc + dev_num
-        if dev_name in symlinks:
-            symlinks[dev_name]['target'] = df
-        #else:
-        #    throw('Unexpected device /dev/%s' % (df))
-
     # create symlinks
     for dev_name, d in symlinks.items():
         lnk = d['link']
@@ -507,20 +621,12 @@ def ifaces_init(config):
 
     # net
 
-    for n in range(len(netdevs)):
-        if not os.path.isdir('/sys/class/net/%s%d' % (HWEMU_NETDEV_NAME, n)):
-            throw("Couldn't create device %s" % (netdevs[n]))
-
-        # Bring the interface online.
+    # The kernel module names the network devices after their
+    # sections and brings them up (see load_from_ini() in hwectl.py).
 
-        # XXX Assume iproute2 is installed on your system (on most
-        # systems, it is). Otherwise, we could implement this via
-        # ioctl SIOCGIFFLAGS/SIOCSIFFLAGS, e.g:
-        # + https://www.oreilly.com/library/view/python-cookbook/0596001673/ch07s05.html
-        # + https://stackoverflow.com/questions/20420937/how-to-assign-ip-address-to-interface-in-python
-        # + https://stackoverflow.com/questions/6067405/python-sockets-enabling-promiscuous-mode-in-linux
-
-        run(['ip', 'link', 'set', HWEMU_NETDEV_NAME + str(n), 'up'])
+    for lnk in netdevs:
+        if not os.path.isdir('/sys/class/net/%s' % (lnk)):
+            throw("Couldn't create device %s" % (lnk))
 
 # ----------------------------------------------------------------------
 
@@ -530,9 +636,9 @@ def ifaces_cleanup():
 
     # i2c
 
-    # Earlier on we ensured that i2c-dev was loaded and now we have
-    # no way of knowing whether or not it had been loaded before. So we
-    # just leave it loaded :(
+    # The kernel module loads i2c-dev along with the first adapter and
+    # we have no way of knowing whether or not it had been loaded before.
+    # So we just leave it loaded :(
     # Besides, we assume that this function may be called in cmd_start,
     # that is BEFORE i2c-dev is first loaded.
 
@@ -577,17 +683,10 @@ def run(args):
 
 # ----------------------------------------------------------------------
 
-def test_random_config_write():
+def prepare_test():
     '''
-        Configuration test
-
-        1. create a random configuration;
-        2. load it into the module;
-        3. read the configuration from the module;
-        4. compare what was written with what was read;
-        5. repeat the previous steps.
+    Load the kernel module afresh and limit the size of random configs
     '''
-
     if os.geteuid() != 0:
         sys.exit('You must be root to run this script')
 
@@ -614,6 +713,58 @@ def test_random_config_write():
 
     print('WARNING: With large maximum values, creating random configs may take a VERY long time.')
 
+# ----------------------------------------------------------------------
+
+def rand_labeled_config():
+    '''
+    Return a random config whose devices have the labels of ini file
+    sections, e.g. ttyUSB3 for tty3, so that reload_config() can match
+    them
+    '''
+    cfg = rand_config()
+    for ifc in IFACES:
+        for dev_name, d in cfg[ifc].items():
+            d['_extern_dev_name'] = EXTERN_DEV_NAME_PREFIXES[ifc] + \
+                dev_name[len(ifc):]
+    return cfg
+
+# ----------------------------------------------------------------------
+
+def read_labeled_config():
+    '''
+    Read the config from the module, naming the devices after their
+    labels (see rand_labeled_config()) rather than as in sysfs
+    '''
+    cfg = read_config()
+
+    for ifc in IFACES:
+        pfx = EXTERN_DEV_NAME_PREFIXES[ifc]
+        devs = {}
+        for dev_name, pairs in cfg[ifc].items():
+            label = read_file('%s/%s/%s/label' % \
+                (SYSFS_BASE_DIR, ifc, dev_name)).rstrip()
+            if not label.startswith(pfx):
+                throw('Device %s has an unexpected label: "%s"' % (dev_name, label))
+            devs[ifc + label[len(pfx):]] = pairs
+        cfg[ifc] = devs
+
+    return cfg
+
+# ----------------------------------------------------------------------
+
+def test_random_config_write():
+    '''
+        Configuration test
+
+        1. create a random configuration;
+        2. load it into the module;
+        3. read the configuration from the module;
+        4. compare what was written with what was read;
+        5. repeat the previous steps.
+    '''
+
+    prepare_test()
+
     _REPEATS = 50
 
     for i in range(_REPEATS):
@@ -649,9 +800,64 @@ def test_random_config_write():
 
     run(['rmmod', KMOD_NAME])
 
+# ----------------------------------------------------------------------
+
+def test_random_config_reload():
+    '''
+        Reload test
+
+        1. load a random configuration into the module;
+        2. reload another random configuration over it, which keeps
+           the devices with the same labels and replaces the others;
+        3. read the configuration from the module;
+        4. compare what was reloaded with what was read;
+        5. repeat the previous three steps.
+    '''
+
+    prepare_test()
+
+    print('Writing initial config...')
+
+    write_config(rand_labeled_config())
+
+    _REPEATS = 50
+
+    for i in range(_REPEATS):
+        print('--- Test %d of %d --------------------' % (i + 1, _REPEATS))
+        print('Creating random config...')
+
+        cfg1 = rand_labeled_config()
+
+        print('Config:')
+        print(config_to_pretty_str(cfg1), end = '')
+        print('Reloading config...')
+
+        reload_config(cfg1)
+
+        print('Reading config...')
+
+        cfg2 = read_labeled_config()
+
+        s1 = config_to_str(cfg1)
+        s2 = config_to_str(cfg2)
+
+        print('Comparing configs...')
+
+        if s1 == s2:
+            print('OK')
+        else:
+            print('*** ERROR: Configs do not match!')
+            print(s1)
+            print('--------------------------------')
+            print(s2)
+
+    erase_config()
+
+    run(['rmmod', KMOD_NAME])
 
 # ----------------------------------------------------------------------
 
 if __name__ == '__main__':
     test_random_config_write()
+    test_random_config_reload()
 
@@ -0,0 +1,198 @@
+#!/usr/bin/env python3
+import os
+import sys
+import random
+from ctypes import Structure, POINTER, c_uint8, c_uint16, c_uint32
+from fcntl import ioctl
+
+PROG_DIR = os.path.dirname(os.path.realpath(__file__))
+
+_IMPORT_DIRS = ('../control',)
+
+for d in _IMPORT_DIRS:
+    p = os.path.realpath('/'.join((PROG_DIR, d)))
+    if os.path.isdir(p):
+        sys.path.append(p)
+
+import hwectl
+import config_sysfs as config
+
+# see linux/i2c.h and linux/i2c-dev.h
+
+I2C_RDWR = 0x0707
+
+I2C_M_RD = 0x0001
+I2C_M_TEN = 0x0010
+
+class i2c_msg(Structure):
+    _fields_ = [
+        ('addr', c_uint16),
+        ('flags', c_uint16),
+        ('len', c_uint16),
+        ('buf', POINTER(c_uint8)),
+    ]
+
+class i2c_rdwr_ioctl_data(Structure):
+    _fields_ = [
+        ('msgs', POINTER(i2c_msg)),
+        ('nmsgs', c_uint32),
+    ]
+
+# ----------------------------------------------------------------------
+
+def throw(msg):
+    raise Exception(msg)
+
+# ----------------------------------------------------------------------
+
+def green(text):
+    return '\033[32m' + text + '\033[0m'
+
+# ----------------------------------------------------------------------
+
+def red(text):
+    return '\033[31m' + text + '\033[0m'
+
+# ----------------------------------------------------------------------
+
+def cyan(text):
+    return '\033[36m' + text + '\033[0m'
+
+# ----------------------------------------------------------------------
+
+def i2c_transaction(fd, addr, *msgs):
+    '''
+    Perform an I2C transaction: a write for each bytes object in msgs
+    and a read for each integer, the number of bytes to read, with a
+    repeated start in between. Return the bytes read, one bytes object
+    for each read.
+    '''
+    flags = I2C_M_TEN if addr > 0x7F else 0
+    arr = (i2c_msg * len(msgs))()
+    bufs = []
+
+    for i, m in enumerate(msgs):
+        if isinstance(m, int):
+            buf = (c_uint8 * m)()
+            arr[i] = i2c_msg(addr, flags | I2C_M_RD, m, buf)
+        else:
+            buf = (c_uint8 * len(m))(*m)
+            arr[i] = i2c_msg(addr, flags, len(m), buf)
+        bufs.append(buf)
+
+    ioctl(fd, I2C_RDWR, i2c_rdwr_ioctl_data(arr, len(msgs)))
+
+    return [bytes(b) for m, b in zip(msgs, bufs) if isinstance(m, int)]
+
+# ----------------------------------------------------------------------
+
+def i2c_check_regmap(adapter, addr, addr_width, page_size):
+    '''
+    Write random data to the registers of the client at addr, then
+    select the first register again and read the data back in a single
+    transaction, as an EEPROM driver does.
+    '''
+    IND1 = ' ' * 8
+    IND2 = ' ' * 16
+
+    n = min(16, page_size) if page_size else 16
+    reg = random.randrange(0, 256, n)
+    reg_bytes = reg.to_bytes(addr_width, 'big')
+    data = bytes(random.randint(0, 255) for i in range(n))
+
+    fd = os.open('/dev/i2c-%d' % (adapter), os.O_RDWR)
+
+    try:
+        i2c_transaction(fd, addr, reg_bytes + data)
+        lst = i2c_transaction(fd, addr, reg_bytes, n)
+    finally:
+        os.close(fd)
+
+    ok = data == lst[0]
+
+    print(IND1 + 'Written data at 0x%x:' % (reg))
+    print(IND2 + config.bytes_to_hex_str(data))
+    print(IND1 + 'Read data:')
+    print(IND2 + config.bytes_to_hex_str(lst[0]))
+    print(IND1 + 'Result:')
+    print(IND2 + (ok and green('*** PASSED ***') or
+        red('*** FAILED ***')))
+
+    return ok
+
+# ----------------------------------------------------------------------
+
+def main():
+    argc = len(sys.argv)
+    argv = sys.argv
+    if argc != 2:
+        print('Usage:')
+        print('    FIRST:')
+        print('    $ hwectl start <ini-filename>')
+        print('    THEN:')
+        print('    $ sudo python3 %s <ini-filename>' %
+            (os.path.basename(__file__)))
+        return 1
+
+    exitcode = 0
+
+    filename = argv[1]
+
+    cfg = hwectl.load_from_ini(filename)
+
+    random.seed()
+
+    def error(msg):
+        throw(('%s.\nMake sure the file "%s" has been loaded by using hwectl') %
+              (msg, filename))
+
+    def on_dev(iface_name, dev_name):
+        if iface_name != config.IF_I2C:
+            return
+
+        d = cfg[iface_name][dev_name]
+        opts = d.get('_options', {})
+
+        # only the register-based clients here
+        if d.get('_parent') is None or not int(opts.get('regmap', '0'), 0):
+            return
+
+        sect = d.get('_extern_dev_name')
+        parent, addr = sect.split(':', 1)
+        width = int(opts.get('addr_width', '1'), 0)
+        lnk = '/dev/' + parent
+
+        if not width:
+            # the register can't be selected again
+            print(cyan('%s:' % sect) + ' skipped: addr_width is 0')
+            return
+
+        # no symlink if the node has the name of the section already
+        # (see ifaces_init())
+        if not os.path.exists(lnk):
+            error('File not found: ' + lnk)
+
+        tgt = os.path.realpath(lnk)
+        num = tgt[len('/dev/i2c-'):]
+
+        if not tgt.startswith('/dev/i2c-') or not num.isdigit():
+            error('Wrong link: %s -> %s' % (lnk, tgt))
+
+        print(cyan('%s:' % sect))
+
+        ok = i2c_check_regmap(int(num), int(addr, 16), width,
+            int(opts.get('page_size', '0'), 0))
+
+        nonlocal exitcode
+
+        if not ok:
+            exitcode = 1
+
+    config.traverse_config(cfg, on_iface = None, on_dev = on_dev, on_pair = None)
+
+    return exitcode
+
+# ----------------------------------------------------------------------
+
+if __name__ == '__main__':
+    sys.exit(main())
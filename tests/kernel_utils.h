@@ -27,15 +27,31 @@
 #define simple_strtoull strtoull
 #define jiffies_to_msecs
 #define msecs_to_jiffies
+#define list_for_each_entry_rcu list_for_each_entry
 
 typedef uint8_t u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
+typedef uint64_t u64;
 
 struct kobj_attribute {
 	char dummy;
 };
 
+struct attribute {
+	const char * name;
+};
+
+struct kref {
+	int refcount;
+};
+
+struct rcu_head {
+	void * next;
+};
+
+struct kobject;
+
 extern int hex2bin(u8 *dst, const char *src, size_t count);
 extern char *bin2hex(char *dst, const void *src, size_t count);
 extern int scnprintf(char *buf, size_t size, const char *fmt, ...);
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <time.h>
 
 #include "kernel_utils.h"
@@ -84,6 +85,70 @@ static int test(int count)
 	return ok;
 }
 
+/*! Checks hwe_next_option() against the options expected in \a str,
+ * given as name-value pairs ending with NULL, with buffers of
+ * \a size bytes. */
+static int check_options(const char * str, size_t size, ...)
+{
+	int ok = 1;
+	const char * s = str;
+	const char * exp_name;
+	char name[64];
+	char value[64];
+	va_list ap;
+
+	va_start(ap, size);
+
+	while (ok && (exp_name = va_arg(ap, const char *))) {
+		const char * exp_value = va_arg(ap, const char *);
+
+		s = hwe_next_option(s, name, size, value, size);
+
+		if (!s) {
+			printf("*** ERROR: `%s': option `%s' missing\n",
+				str, exp_name);
+			ok = 0;
+		}
+		else
+		if (!streq(name, exp_name) || !streq(value, exp_value)) {
+			printf("*** ERROR: `%s': got `%s'=`%s' "
+				"instead of `%s'=`%s'\n",
+				str, name, value, exp_name, exp_value);
+			ok = 0;
+		}
+	}
+
+	va_end(ap);
+
+	if (ok && hwe_next_option(s, name, size, value, size)) {
+		printf("*** ERROR: `%s': unexpected option `%s'\n", str, name);
+		ok = 0;
+	}
+
+	return ok;
+}
+
+static int test_options(void)
+{
+	int ok = 1;
+
+	puts("Testing the option parser ...");
+
+	ok &= check_options("name=value", 64, "name", "value", NULL);
+	ok &= check_options("up", 64, "up", "", NULL);
+	ok &= check_options("parent=i2c0 addr=0x50", 64,
+		"parent", "i2c0", "addr", "0x50", NULL);
+	ok &= check_options("  \tname=value   up \n", 64,
+		"name", "value", "up", "", NULL);
+	ok &= check_options("   ", 64, NULL);
+	ok &= check_options("", 64, NULL);
+	/* too long for the buffers of 4 bytes */
+	ok &= check_options("abcdef=123456 x=1", 4,
+		"abc", "123", "x", "1", NULL);
+
+	return ok;
+}
+
 static int check_pair(const char * pair_str)
 {
 	struct hwe_pair p;
@@ -106,9 +171,9 @@ static void print_usage(void)
 "  pair_parser --test [<count>]\n"
 "  pair_parser -t [<count>]\n"
 "\n"
-"        Creates a random pair, and tests pair parser functions on it.\n"
-"        The test is repeated <count> times. If <count> is not specified,\n"
-"        a random <count> is assigned.\n"
+"        Tests the option parser, then creates a random pair, and tests\n"
+"        pair parser functions on it. The latter test is repeated <count>\n"
+"        times. If <count> is not specified, a random <count> is assigned.\n"
 "\n"
 "  pair_parser --check <pair string>\n"
 "  pair_parser -c <pair string>\n"
@@ -148,7 +213,7 @@ int main(int argc, char **argv)
 				count = rnd(1, 0xffff);
 			}
 
-			ok = test(count);
+			ok = test_options() && test(count);
 		}
 	}
 	else
@@ -66,7 +66,7 @@ class SPIDevice:
 #        ioctl(self.fd, SPI_IOC_MESSAGE(transfer_count), addressof(ioctl_arg))
         ioctl(self.fd, SPI_IOC_MESSAGE(transfer_count), ioctl_arg)
 
-        return [transfer.to_read_bytes() for t in transfers if t.has_read_buf]
+        return [t.to_read_bytes() for t in transfers if t.has_read_buf]
 
     def close(self):
         """
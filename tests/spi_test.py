@@ -46,7 +46,13 @@ def yellow(text):
 
 # ----------------------------------------------------------------------
 
-def spi_check_query(bus, cs, request, expected_response):
+def spi_check_query(bus, cs, request, expected_response, turnaround = None):
+    '''
+    Write request and read the response. In half-duplex mode, i.e. when
+    turnaround is None, these are two transactions. In full-duplex
+    mode, this is a single transaction: the request, turnaround dummy
+    bytes, then the response.
+    '''
     IND1 = ' ' * 8
     IND2 = ' ' * 16
 
@@ -61,16 +67,23 @@ def spi_check_query(bus, cs, request, expected_response):
         return ret
 
     with SPIDevice(cs, bus) as spi:
-        spi.transaction(writing(request))
-        lst = spi.transaction(reading(len(expected_response)))
-        ok = expected_response == lst[0]
+        if turnaround is None:
+            spi.transaction(writing(request))
+            lst = spi.transaction(reading(len(expected_response)))
+        else:
+            transfers = [writing(request)]
+            if turnaround:
+                transfers.append(writing(bytes(turnaround)))
+            transfers.append(reading(len(expected_response)))
+            lst = spi.transaction(*transfers)
+        ok = expected_response == lst[-1]
 
         print(IND1 + 'Written data:')
         print(hexlns(request))
         print(IND1 + 'Expected data:')
         print(hexlns(expected_response))
         print(IND1 + 'Read data:')
-        print(hexlns(lst[0]))
+        print(hexlns(lst[-1]))
         print(IND1 + 'Result:')
         print(IND2 + (ok and green('*** PASSED ***') or
             red('*** FAILED ***')))
@@ -180,9 +193,16 @@ def main():
 
         p = pair.split('=')
 
-        print(cyan('%s:' % d))
+        opts = cfg[iface_name][dev_name].get('_options', {})
+        turnaround = None
 
-        ok = spi_check_query(int(nums[0]), int(nums[1]), bytes.fromhex(p[0]), bytes.fromhex(p[1]))
+        if int(opts.get('full_duplex', '0'), 0):
+            turnaround = int(opts.get('turnaround', '0'), 0)
+
+        print(cyan('%s%s:' % (d, turnaround is not None and ' (full duplex)' or '')))
+
+        ok = spi_check_query(int(nums[0]), int(nums[1]), bytes.fromhex(p[0]),
+            bytes.fromhex(p[1]), turnaround)
 
         nonlocal exitcode
 